@@ -12,14 +12,23 @@ extern struct bus_type ldd_bus_type;
  * The LDD driver type.
  */
 
+struct ldd_device;
+
 struct ldd_driver {
 	char *version;
 	struct module *module;
 	struct device_driver driver;
 	struct driver_attribute version_attr;
+	/* optional: create and destroy devices through the bus attributes */
+	int (*new_device)(struct ldd_driver *);
+	int (*delete_device)(struct ldd_device *);
+	/* optional: bind to and unbind from a device */
+	int (*probe)(struct ldd_device *);
+	void (*remove)(struct ldd_device *);
+	int prefer_async;	/* probe devices in parallel, off the caller */
 };
 
-#define to_ldd_driver(drv) container_of(drv, struct ldd_driver, driver);
+#define to_ldd_driver(drv) container_of(drv, struct ldd_driver, driver)
 
 /*
  * A device type for things "plugged" into the LDD bus.
@@ -29,11 +38,15 @@ struct ldd_device {
 	char *name;
 	struct ldd_driver *driver;
 	struct device dev;
+	void *data;		/* the driver's, for allocated devices */
+	int allocated;		/* by ldd_alloc_device(): freed on release */
 };
 
-#define to_ldd_device(dev) container_of(dev, struct ldd_device, dev);
+#define to_ldd_device(dev) container_of(dev, struct ldd_device, dev)
 
+extern struct ldd_device *ldd_alloc_device(const char *);
 extern int register_ldd_device(struct ldd_device *);
+extern int register_ldd_devices(struct ldd_device **, int *, int);
 extern void unregister_ldd_device(struct ldd_device *);
 extern int register_ldd_driver(struct ldd_driver *);
 extern void unregister_ldd_driver(struct ldd_driver *);
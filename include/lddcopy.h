@@ -0,0 +1,30 @@
+/*
+ * Definitions for the LDD copy engine, a pretend DMA device on the
+ * virtual LDD bus.
+ *
+ * A copy is a list of descriptors, each moving up to a page between
+ * two pages. Descriptors are copied into the engine's submission ring,
+ * so they can live on the caller's stack. A descriptor with a callback
+ * raises a completion, delivered when the engine "interrupts": after
+ * ldd_copy_coalesce completions, or when it runs out of work. Callbacks
+ * run in the engine's thread; like interrupt handlers, they should be
+ * short and must not sleep.
+ */
+
+#ifndef _LDDCOPY_H
+#define _LDDCOPY_H
+
+struct page;
+
+struct ldd_copy_desc {
+	struct page *src, *dst;
+	unsigned int src_off, dst_off;
+	unsigned int len;		/* both ranges stay within their page */
+	void (*callback)(void *context, int status);
+	void *context;
+};
+
+extern int ldd_copy_submit(const struct ldd_copy_desc *descs, int n);
+extern int ldd_copy_max_descs(void);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _SHRINKER_VERSION_H
+#define _SHRINKER_VERSION_H
+
+#include <linux/version.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+/*
+ * register_shrinker() takes a name since 6.0, and since 6.7 shrinkers
+ * are allocated by the core with shrinker_alloc().  Hide both behind
+ * a create/destroy pair that always hands back an allocated shrinker.
+ */
+static inline struct shrinker *shrinker_create_wrapper(const char *name,
+		unsigned long (*count)(struct shrinker *, struct shrink_control *),
+		unsigned long (*scan)(struct shrinker *, struct shrink_control *))
+{
+	struct shrinker *s;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	s->count_objects = count;
+	s->scan_objects = scan;
+	s->seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+	if (register_shrinker(s)) {
+#else
+	if (register_shrinker(s, "%s", name)) {
+#endif
+		kfree(s);
+		return NULL;
+	}
+#else
+	s = shrinker_alloc(0, "%s", name);
+	if (!s)
+		return NULL;
+	s->count_objects = count;
+	s->scan_objects = scan;
+	shrinker_register(s);
+#endif
+	return s;
+}
+
+static inline void shrinker_destroy_wrapper(struct shrinker *s)
+{
+	if (!s)
+		return;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+	unregister_shrinker(s);
+	kfree(s);
+#else
+	shrinker_free(s);
+#endif
+}
+
+#endif
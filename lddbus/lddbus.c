@@ -21,7 +21,9 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/string.h>
+#include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/async.h>
 #include "lddbus.h"
 
 MODULE_AUTHOR("Jonathan Corbet");
@@ -52,6 +54,36 @@ static int ldd_match(struct device *dev, struct device_driver *driver)
 }
 
 
+/*
+ * Binding, for drivers that want to know: the driver core calls
+ * these, possibly from several threads at once for a driver that
+ * prefers asynchronous probing.
+ */
+static int ldd_probe(struct device *dev)
+{
+	struct ldd_driver *ldriver = to_ldd_driver(dev->driver);
+	struct ldd_device *ldddev = to_ldd_device(dev);
+
+	return ldriver->probe ? ldriver->probe(ldddev) : 0;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0))
+static int ldd_remove(struct device *dev)
+#else
+static void ldd_remove(struct device *dev)
+#endif
+{
+	struct ldd_driver *ldriver = to_ldd_driver(dev->driver);
+	struct ldd_device *ldddev = to_ldd_device(dev);
+
+	if (ldriver->remove)
+		ldriver->remove(ldddev);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0))
+	return 0;
+#endif
+}
+
+
 /*
  * The LDD bus device.
  */
@@ -72,6 +104,8 @@ struct bus_type ldd_bus_type = {
 	.name = "ldd",
 	.match = ldd_match,
 	.uevent  = ldd_uevent,
+	.probe = ldd_probe,
+	.remove = ldd_remove,
 };
 
 /*
@@ -90,6 +124,73 @@ static ssize_t version_show(const struct bus_type *bus, char *buf)
 
 static BUS_ATTR_RO(version);
 
+/*
+ * Devices can be added and removed at run time, by drivers that know
+ * how: write the name of the driver to "new_device" to get a new
+ * device of it, and the name of a device to "delete_device" to remove
+ * it. The bus just finds the right driver and lets it do the job.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0))
+static ssize_t new_device_store(struct bus_type *bus, const char *buf,
+		size_t count)
+#else
+static ssize_t new_device_store(const struct bus_type *bus, const char *buf,
+		size_t count)
+#endif
+{
+	struct device_driver *driver;
+	struct ldd_driver *ldriver;
+	char name[32];
+	int ret;
+
+	strscpy(name, buf, sizeof(name));
+	driver = driver_find(strim(name), &ldd_bus_type);
+	if (!driver)
+		return -ENODEV;
+	ldriver = to_ldd_driver(driver);
+	if (!ldriver->new_device)
+		return -EOPNOTSUPP;
+	if (!try_module_get(ldriver->module))
+		return -ENODEV;
+	ret = ldriver->new_device(ldriver);
+	module_put(ldriver->module);
+	return ret ? ret : count;
+}
+
+static BUS_ATTR_WO(new_device);
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0))
+static ssize_t delete_device_store(struct bus_type *bus, const char *buf,
+		size_t count)
+#else
+static ssize_t delete_device_store(const struct bus_type *bus, const char *buf,
+		size_t count)
+#endif
+{
+	struct device *dev;
+	struct ldd_device *ldddev;
+	struct ldd_driver *ldriver;
+	char name[32];
+	int ret = -EOPNOTSUPP;
+
+	strscpy(name, buf, sizeof(name));
+	dev = bus_find_device_by_name(&ldd_bus_type, NULL, strim(name));
+	if (!dev)
+		return -ENODEV;
+	/* our reference keeps the device around until we are done */
+	ldddev = to_ldd_device(dev);
+	ldriver = ldddev->driver;
+	if (ldriver && ldriver->delete_device &&
+			try_module_get(ldriver->module)) {
+		ret = ldriver->delete_device(ldddev);
+		module_put(ldriver->module);
+	}
+	put_device(dev);
+	return ret ? ret : count;
+}
+
+static BUS_ATTR_WO(delete_device);
+
 
 
 /*
@@ -97,12 +198,37 @@ static BUS_ATTR_RO(version);
  */
 
 /*
- * For now, no references to LDDbus devices go out which are not
- * tracked via the module reference count, so we use a no-op
- * release function.
+ * A device embedded in a driver's structure lives as long as the
+ * driver module, so releasing it is a no-op. One from
+ * ldd_alloc_device() is freed with its last reference, which may go
+ * after the driver has let go of it.
  */
 static void ldd_dev_release(struct device *dev)
-{ }
+{
+	struct ldd_device *ldddev = to_ldd_device(dev);
+
+	if (ldddev->allocated)
+		kfree(ldddev);
+}
+
+/*
+ * Allocate a device, for drivers that add and remove devices at run
+ * time. Free it with put_device() once it has been registered, even
+ * if the registration failed, and with kfree() before.
+ */
+struct ldd_device *ldd_alloc_device(const char *name)
+{
+	struct ldd_device *ldddev;
+
+	ldddev = kzalloc(sizeof(*ldddev) + strlen(name) + 1, GFP_KERNEL);
+	if (!ldddev)
+		return NULL;
+	ldddev->name = (char *) (ldddev + 1);
+	strcpy(ldddev->name, name);
+	ldddev->allocated = 1;
+	return ldddev;
+}
+EXPORT_SYMBOL(ldd_alloc_device);
 
 int register_ldd_device(struct ldd_device *ldddev)
 {
@@ -114,6 +240,50 @@ int register_ldd_device(struct ldd_device *ldddev)
 }
 EXPORT_SYMBOL(register_ldd_device);
 
+/*
+ * Register a number of devices in parallel: registration sleeps on
+ * sysfs and uevents, and binding a driver that doesn't prefer
+ * asynchronous probing runs its probe right there. "errs" gets the
+ * result of every registration; the return value is the first error.
+ */
+struct ldd_reg {
+	struct ldd_device *ldddev;
+	int *err;
+};
+
+static void ldd_register_async(void *data, async_cookie_t cookie)
+{
+	struct ldd_reg *reg = data;
+
+	*reg->err = register_ldd_device(reg->ldddev);
+}
+
+int register_ldd_devices(struct ldd_device **ldddevs, int *errs, int n)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	struct ldd_reg *regs;
+	int i, ret = 0;
+
+	regs = kmalloc_array(n, sizeof(*regs), GFP_KERNEL);
+	if (!regs) { /* do it the slow way */
+		for (i = 0; i < n; i++)
+			errs[i] = register_ldd_device(ldddevs[i]);
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		regs[i].ldddev = ldddevs[i];
+		regs[i].err = errs + i;
+		async_schedule_domain(ldd_register_async, regs + i, &domain);
+	}
+	async_synchronize_full_domain(&domain);
+	kfree(regs);
+  out:
+	for (i = 0; i < n && !ret; i++)
+		ret = errs[i];
+	return ret;
+}
+EXPORT_SYMBOL(register_ldd_devices);
+
 void unregister_ldd_device(struct ldd_device *ldddev)
 {
 	device_unregister(&ldddev->dev);
@@ -139,6 +309,8 @@ int register_ldd_driver(struct ldd_driver *driver)
 	int ret;
 	
 	driver->driver.bus = &ldd_bus_type;
+	if (driver->prefer_async)
+		driver->driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
 	ret = driver_register(&driver->driver);
 	if (ret)
 		return ret;
@@ -146,7 +318,10 @@ int register_ldd_driver(struct ldd_driver *driver)
 	driver->version_attr.attr.mode = S_IRUGO;
 	driver->version_attr.show = show_version;
 	driver->version_attr.store = NULL;
-	return driver_create_file(&driver->driver, &driver->version_attr);
+	ret = driver_create_file(&driver->driver, &driver->version_attr);
+	if (ret)
+		driver_unregister(&driver->driver);
+	return ret;
 }
 
 void unregister_ldd_driver(struct ldd_driver *driver)
@@ -169,6 +344,9 @@ static int __init ldd_bus_init(void)
 	}
 	if (bus_create_file(&ldd_bus_type, &bus_attr_version))
 		printk(KERN_ERR "Unable to create version attribute\n");
+	if (bus_create_file(&ldd_bus_type, &bus_attr_new_device) ||
+	    bus_create_file(&ldd_bus_type, &bus_attr_delete_device))
+		printk(KERN_ERR "Unable to create device attributes\n");
 	dev_set_name(&ldd_bus,"ldd0");
 	ret = device_register(&ldd_bus);
 	if (ret) {
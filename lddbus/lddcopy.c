@@ -0,0 +1,276 @@
+/*
+ * A pretend DMA copy engine for the virtual LDD bus.
+ *
+ * The "hardware" is a kernel thread. Drivers put descriptors in a
+ * submission ring; the engine fetches them in batches, copies the data
+ * and queues a completion for every descriptor that asks for one. The
+ * completions are delivered by an "interrupt": the engine runs the
+ * callbacks once ldd_copy_coalesce of them are pending, or when it has
+ * nothing left to do. Batch size and coalescing can be changed while
+ * the engine runs, to see what they do to throughput and latency.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/device.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include "lddbus.h"
+#include "lddcopy.h"
+
+MODULE_AUTHOR("Jonathan Corbet");
+MODULE_LICENSE("Dual BSD/GPL");
+
+static int ldd_copy_ring = 256;		/* descriptors, a power of two */
+static int ldd_copy_batch = 16;		/* descriptors fetched at a time */
+static int ldd_copy_coalesce = 8;	/* completions per interrupt */
+
+module_param(ldd_copy_ring, int, 0);
+module_param(ldd_copy_batch, int, 0644);
+module_param(ldd_copy_coalesce, int, 0644);
+
+/*
+ * The submission ring. "head" is where drivers add descriptors, "tail"
+ * is where the engine takes them; both only grow, and the ring holds
+ * head - tail descriptors. The lock protects both and the slots in
+ * between.
+ */
+static struct ldd_copy_desc *ldd_copy_sq;
+static unsigned int ldd_copy_head, ldd_copy_tail;
+static DEFINE_SPINLOCK(ldd_copy_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ldd_copy_wait);	/* the engine waits for work */
+static DECLARE_WAIT_QUEUE_HEAD(ldd_copy_room);	/* drivers wait for room */
+
+/*
+ * The completion queue belongs to the engine thread alone.
+ */
+struct ldd_copy_done {
+	void (*callback)(void *context, int status);
+	void *context;
+	int status;
+};
+static struct ldd_copy_done *ldd_copy_cq;
+static int ldd_copy_ncq;
+
+static struct task_struct *ldd_copy_task;
+
+/* statistics, updated by the engine only */
+static unsigned long ldd_copy_descs, ldd_copy_bytes;
+static unsigned long ldd_copy_batches, ldd_copy_irqs;
+
+static unsigned int ldd_copy_used(void)
+{
+	return READ_ONCE(ldd_copy_head) - READ_ONCE(ldd_copy_tail);
+}
+
+/*
+ * Queue a list of descriptors, waiting for room in the ring if needed.
+ * A list longer than the ring can never go in.
+ */
+int ldd_copy_submit(const struct ldd_copy_desc *descs, int n)
+{
+	int i, err;
+
+	if (n <= 0 || n > ldd_copy_ring)
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+		if (descs[i].src_off + descs[i].len > PAGE_SIZE ||
+				descs[i].dst_off + descs[i].len > PAGE_SIZE)
+			return -EINVAL;
+
+	spin_lock(&ldd_copy_lock);
+	while (ldd_copy_ring - (ldd_copy_head - ldd_copy_tail) < n) {
+		spin_unlock(&ldd_copy_lock);
+		err = wait_event_interruptible(ldd_copy_room,
+				ldd_copy_ring - ldd_copy_used() >= n);
+		if (err)
+			return err;
+		spin_lock(&ldd_copy_lock);
+	}
+	for (i = 0; i < n; i++)
+		ldd_copy_sq[(ldd_copy_head + i) & (ldd_copy_ring - 1)] = descs[i];
+	ldd_copy_head += n;
+	spin_unlock(&ldd_copy_lock);
+	wake_up(&ldd_copy_wait);
+	return 0;
+}
+EXPORT_SYMBOL(ldd_copy_submit);
+
+int ldd_copy_max_descs(void)
+{
+	return ldd_copy_ring;
+}
+EXPORT_SYMBOL(ldd_copy_max_descs);
+
+/*
+ * The data transfer of a descriptor.
+ */
+static void ldd_copy_one(const struct ldd_copy_desc *desc)
+{
+	void *src, *dst;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+	src = kmap_atomic(desc->src);
+	dst = kmap_atomic(desc->dst);
+	memcpy(dst + desc->dst_off, src + desc->src_off, desc->len);
+	kunmap_atomic(dst);
+	kunmap_atomic(src);
+#else
+	src = kmap_local_page(desc->src);
+	dst = kmap_local_page(desc->dst);
+	memcpy(dst + desc->dst_off, src + desc->src_off, desc->len);
+	kunmap_local(dst);
+	kunmap_local(src);
+#endif
+	ldd_copy_bytes += desc->len;
+}
+
+/*
+ * The "interrupt": deliver all the pending completions.
+ */
+static void ldd_copy_irq(void)
+{
+	int i;
+
+	if (!ldd_copy_ncq)
+		return;
+	for (i = 0; i < ldd_copy_ncq; i++)
+		ldd_copy_cq[i].callback(ldd_copy_cq[i].context,
+				ldd_copy_cq[i].status);
+	ldd_copy_ncq = 0;
+	ldd_copy_irqs++;
+}
+
+static int ldd_copy_thread(void *unused)
+{
+	struct ldd_copy_desc *desc;
+	unsigned int i, n;
+	int idle;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ldd_copy_wait,
+				ldd_copy_used() || kthread_should_stop());
+
+		/* fetch a batch; the slots stay ours until "tail" moves */
+		spin_lock(&ldd_copy_lock);
+		n = min_t(unsigned int, ldd_copy_head - ldd_copy_tail,
+				max(READ_ONCE(ldd_copy_batch), 1));
+		spin_unlock(&ldd_copy_lock);
+		if (!n)
+			continue;
+		for (i = 0; i < n; i++) {
+			desc = ldd_copy_sq + ((ldd_copy_tail + i) & (ldd_copy_ring - 1));
+			ldd_copy_one(desc);
+			if (!desc->callback)
+				continue;
+			if (ldd_copy_ncq == ldd_copy_ring)
+				ldd_copy_irq();
+			ldd_copy_cq[ldd_copy_ncq].callback = desc->callback;
+			ldd_copy_cq[ldd_copy_ncq].context = desc->context;
+			ldd_copy_cq[ldd_copy_ncq].status = 0;
+			ldd_copy_ncq++;
+		}
+		spin_lock(&ldd_copy_lock);
+		ldd_copy_tail += n;
+		idle = ldd_copy_head == ldd_copy_tail;
+		spin_unlock(&ldd_copy_lock);
+		wake_up(&ldd_copy_room);
+		ldd_copy_descs += n;
+		ldd_copy_batches++;
+
+		if (idle || ldd_copy_ncq >= READ_ONCE(ldd_copy_coalesce))
+			ldd_copy_irq();
+		cond_resched();
+	}
+	ldd_copy_irq();
+	return 0;
+}
+
+
+/*
+ * The engine is a device on the bus, with its statistics in sysfs.
+ */
+#define LDD_COPY_SHOW(name, var)					\
+static ssize_t name##_show(struct device *dev,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%lu\n", READ_ONCE(var));			\
+}									\
+static DEVICE_ATTR_RO(name)
+
+LDD_COPY_SHOW(descriptors, ldd_copy_descs);
+LDD_COPY_SHOW(bytes, ldd_copy_bytes);
+LDD_COPY_SHOW(batches, ldd_copy_batches);
+LDD_COPY_SHOW(interrupts, ldd_copy_irqs);
+
+static struct attribute *ldd_copy_attrs[] = {
+	&dev_attr_descriptors.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_batches.attr,
+	&dev_attr_interrupts.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(ldd_copy);
+
+static struct ldd_device ldd_copy_dev = {
+	.name = "lddcopy0",
+	.dev = {
+		.groups = ldd_copy_groups,
+	},
+};
+
+
+static int __init ldd_copy_init(void)
+{
+	int ret = -ENOMEM;
+
+	ldd_copy_ring = roundup_pow_of_two(max(ldd_copy_ring, 16));
+	ldd_copy_sq = kcalloc(ldd_copy_ring, sizeof(*ldd_copy_sq), GFP_KERNEL);
+	ldd_copy_cq = kcalloc(ldd_copy_ring, sizeof(*ldd_copy_cq), GFP_KERNEL);
+	if (!ldd_copy_sq || !ldd_copy_cq)
+		goto fail;
+
+	ldd_copy_task = kthread_run(ldd_copy_thread, NULL, "lddcopy");
+	if (IS_ERR(ldd_copy_task)) {
+		ret = PTR_ERR(ldd_copy_task);
+		goto fail;
+	}
+	ret = register_ldd_device(&ldd_copy_dev);
+	if (ret) {
+		printk(KERN_ERR "Unable to register lddcopy0, failure was %d\n", ret);
+		put_device(&ldd_copy_dev.dev);
+		kthread_stop(ldd_copy_task);
+		goto fail;
+	}
+	return 0;
+
+  fail:
+	kfree(ldd_copy_cq);
+	kfree(ldd_copy_sq);
+	return ret;
+}
+
+static void ldd_copy_exit(void)
+{
+	unregister_ldd_device(&ldd_copy_dev);
+	kthread_stop(ldd_copy_task);
+	kfree(ldd_copy_cq);
+	kfree(ldd_copy_sq);
+}
+
+module_init(ldd_copy_init);
+module_exit(ldd_copy_exit);
@@ -0,0 +1,92 @@
+/*
+ * mapbench.c -- time a sequential scan of a mapped file region
+ *
+ * Like mapper, it maps <len> bytes of <file> from <offset>; then it
+ * reads one word in every page, in order, and reports the time taken,
+ * the throughput in pages per second and the number of page faults.
+ * Run it on scullp or scullv with and without <device>_mmap_populate
+ * to compare fault-per-page mapping with mapping at mmap time.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long minflt(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long offset, len, pos, sum = 0;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	long flt0, flt1, flt2;
+	double t0, t1, t2;
+	volatile unsigned long *word;
+	char *address;
+	int fd;
+
+	if (argc != 4
+	   || sscanf(argv[2], "%li", &offset) != 1
+	   || sscanf(argv[3], "%li", &len) != 1) {
+		fprintf(stderr, "%s: Usage \"%s <file> <offset> <len>\"\n",
+				argv[0], argv[0]);
+		exit(1);
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+		exit(1);
+	}
+
+	flt0 = minflt();
+	t0 = now();
+	address = mmap(0, len, PROT_READ, MAP_SHARED, fd, offset);
+	if (address == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(): %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+	t1 = now();
+	flt1 = minflt();
+	for (pos = 0; pos < len; pos += pagesize) {
+		word = (unsigned long *)(address + pos);
+		sum += *word;
+	}
+	t2 = now();
+	flt2 = minflt();
+
+	printf("%s: %lu pages, checksum %lx\n", argv[1], len / pagesize, sum);
+	printf("  mmap: %10.6f s, %6li faults\n", t1 - t0, flt1 - flt0);
+	printf("  scan: %10.6f s, %6li faults, %.0f pages/s\n", t2 - t1,
+			flt2 - flt1, (len / pagesize) / (t2 - t1));
+	munmap(address, len);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * sbullsnap.c -- take and drop sbull snapshots
+ *
+ * "sbullsnap <disk>" takes a writable snapshot of <disk>, and
+ * "sbullsnap -r <disk>" a read-only one; the name of the new disk is
+ * printed. "sbullsnap -d <disk> <index>" drops the snapshot with that
+ * index; <disk> is any sbull disk. Snapshots take the slots after the
+ * ndevices disks; sbull_load creates their /dev nodes beforehand.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+/* from sbull/sbull.h, which can't be included in user space */
+#define SBULL_IOC_MAGIC  'k'
+#define SBULL_IOCSNAPSHOT _IO(SBULL_IOC_MAGIC, 32)
+#define SBULL_IOCDROP     _IO(SBULL_IOC_MAGIC, 33)
+#define SBULL_SNAP_RO     1
+
+static void usage(char *name)
+{
+	fprintf(stderr, "%s: Usage \"%s [-r] <disk>\" or \"%s -d <disk> <index>\"\n",
+			name, name, name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long flags = 0;
+	int fd, ret, drop = 0;
+	long index = 0;
+	char *name = argv[0];
+
+	if (argc > 1 && !strcmp(argv[1], "-r")) {
+		flags = SBULL_SNAP_RO;
+		argv++; argc--;
+	} else if (argc > 1 && !strcmp(argv[1], "-d")) {
+		drop = 1;
+		argv++; argc--;
+	}
+	if (argc != 2 + drop || (drop && sscanf(argv[2], "%li", &index) != 1))
+		usage(name);
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", name, argv[1], strerror(errno));
+		exit(1);
+	}
+	if (drop)
+		ret = ioctl(fd, SBULL_IOCDROP, index);
+	else
+		ret = ioctl(fd, SBULL_IOCSNAPSHOT, flags);
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s: %s\n", name, argv[1], strerror(errno));
+		exit(1);
+	}
+	if (!drop)
+		printf("sbull%c\n", 'a' + ret);
+	close(fd);
+	return 0;
+}
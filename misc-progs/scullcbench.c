@@ -0,0 +1,166 @@
+/*
+ * scullcbench.c -- compare scullc throughput and memory use across quanta
+ *
+ * For every quantum size given, the device is trimmed (opened write-only),
+ * switched to that quantum and filled with "total" bytes written in records
+ * of "recsize" bytes; the data is then read back with the same record size.
+ * Memory use is what the size-class slab actually holds for the data,
+ * compared with the payload.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+/* from scullc/scullc.h, which can't be included in user space */
+#define SCULLC_IOC_MAGIC  'K'
+#define SCULLC_IOCTQUANTUM _IO(SCULLC_IOC_MAGIC,   2)
+#define SCULLC_IOCQQUANTUM _IO(SCULLC_IOC_MAGIC,   4)
+#define SCULLC_IOCQQSET    _IO(SCULLC_IOC_MAGIC,  10)
+#define SCULLC_CACHE_MIN   256
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the size class used by scullc for a quantum */
+static long slab_size(long quantum)
+{
+	long size = SCULLC_CACHE_MIN;
+
+	while (size < quantum)
+		size <<= 1;
+	return size;
+}
+
+/* loop over short reads and writes, as scullc stops at quantum ends */
+static int xfer(int fd, char *buf, long total, long recsize, int write_it)
+{
+	long done = 0, chunk, n;
+
+	while (done < total) {
+		chunk = total - done < recsize ? total - done : recsize;
+		while (chunk > 0) {
+			if (write_it)
+				n = write(fd, buf, chunk);
+			else
+				n = read(fd, buf, chunk);
+			if (n < 0)
+				return -1;
+			if (n == 0) {
+				errno = EIO; /* short device */
+				return -1;
+			}
+			chunk -= n;
+			done += n;
+		}
+	}
+	return 0;
+}
+
+static int bench(char *dev, long quantum, long total, long recsize, char *buf)
+{
+	int fd, qset;
+	long nquanta, slab, mem, setsize;
+	double t0, tw, tr;
+
+	/* trim, then the empty device takes the new quantum at once */
+	fd = open(dev, O_WRONLY);
+	if (fd < 0 || ioctl(fd, SCULLC_IOCTQUANTUM, quantum) < 0) {
+		fprintf(stderr, "%s: quantum %li: %s\n", dev, quantum,
+				strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, SCULLC_IOCQQUANTUM) != quantum) {
+		fprintf(stderr, "%s: device is busy, quantum not applied\n",
+				dev);
+		close(fd);
+		return -1;
+	}
+	qset = ioctl(fd, SCULLC_IOCQQSET);
+
+	t0 = now();
+	if (xfer(fd, buf, total, recsize, 1) < 0)
+		goto fail;
+	tw = now() - t0;
+	lseek(fd, 0, SEEK_SET);
+	t0 = now();
+	if (xfer(fd, buf, total, recsize, 0) < 0)
+		goto fail;
+	tr = now() - t0;
+	close(fd);
+
+	nquanta = (total + quantum - 1) / quantum;
+	slab = slab_size(quantum);
+	setsize = (nquanta + qset - 1) / qset * (qset * sizeof(void *));
+	mem = nquanta * slab + setsize;
+	printf("%8li %8li %10.1f %10.1f %12li %8.1f%%\n",
+			quantum, slab, total / tw / 1048576, total / tr / 1048576,
+			mem, 100.0 * (mem - total) / total);
+	return 0;
+
+  fail:
+	fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+	close(fd);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	long total, recsize, quantum;
+	char *buf;
+	int i;
+
+	if (argc < 5) {
+		fprintf(stderr, "%s: Usage \"%s <device> <total> <recsize> "
+				"<quantum> [<quantum> ...]\"\n", argv[0], argv[0]);
+		exit(1);
+	}
+	total = strtol(argv[2], NULL, 0);
+	recsize = strtol(argv[3], NULL, 0);
+	if (total <= 0 || recsize <= 0) {
+		fprintf(stderr, "%s: bad sizes\n", argv[0]);
+		exit(1);
+	}
+	buf = malloc(recsize);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 'x', recsize);
+
+	printf("# %s: %li bytes in records of %li bytes\n", argv[1], total,
+			recsize);
+	printf("# quantum     slab   write MB/s  read MB/s   memory (B)  overhead\n");
+	for (i = 4; i < argc; i++) {
+		quantum = strtol(argv[i], NULL, 0);
+		if (bench(argv[1], quantum, total, recsize, buf) < 0)
+			exit(1);
+	}
+	free(buf);
+	return 0;
+}
@@ -24,11 +24,30 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/hdreg.h>	/* HDIO_GETGEO */
 #include <linux/kdev_t.h>
-#include <linux/vmalloc.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>	/* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/workqueue.h>
+#include <linux/string.h>	/* memcpy_flushcache() */
+#if defined(CONFIG_X86_64) && (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0))
+#define SBULL_VECTOR		/* SSE2 copies */
+#include <asm/fpu/api.h>	/* kernel_fpu_begin() */
+#endif
+#include <linux/crypto.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/capability.h>
+
+#include "sbull.h"		/* the ioctl commands */
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -40,6 +59,8 @@ static int nsectors = 1024;	/* How big the drive is */
 module_param(nsectors, int, 0);
 static int ndevices = 4;
 module_param(ndevices, int, 0);
+static int max_snapshots = 4;	/* extra disks, for snapshots */
+module_param(max_snapshots, int, 0);
 
 /*
  * The different "request modes" we can use.
@@ -52,6 +73,117 @@ enum {
 static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
 
+/*
+ * In RM_NOQUEUE mode, a bio of at least parallel_kb KiB is copied in
+ * chunks of parallel_chunk_kb KiB, on several CPUs at once. 0 turns
+ * it off.
+ */
+static int parallel_kb = 512;
+module_param(parallel_kb, int, 0644);
+static int parallel_chunk_kb = 128;
+module_param(parallel_chunk_kb, int, 0644);
+static struct workqueue_struct *sbull_wq;
+
+/*
+ * How the data is copied, for requests (or bios) of at least copy_min
+ * bytes: copy_read for reads, copy_write for writes. 0 is memcpy(), 1
+ * copies with non-temporal stores (memcpy_flushcache()), so that a
+ * large transfer doesn't push everything else out of the caches, and
+ * 2 does the same with 16-byte SSE2 stores on x86-64 (elsewhere, it
+ * is 1). misc-progs/copybench compares them.
+ */
+enum {
+	SBULL_COPY_MEMCPY = 0,
+	SBULL_COPY_NT     = 1,
+	SBULL_COPY_VECTOR = 2,
+};
+static int copy_read = SBULL_COPY_MEMCPY;
+module_param(copy_read, int, 0644);
+static int copy_write = SBULL_COPY_MEMCPY;
+module_param(copy_write, int, 0644);
+static unsigned int copy_min = 256 * 1024;
+module_param(copy_min, uint, 0644);
+
+/*
+ * The blk-mq queues: one hardware context per online CPU by default,
+ * so that submitters don't all meet on the same one.
+ */
+static int nr_hw_queues = 0;
+module_param(nr_hw_queues, int, 0);
+static int queue_depth = 128;
+module_param(queue_depth, int, 0);
+static int poll_queues = 1;	/* extra queues for polled I/O */
+module_param(poll_queues, int, 0);
+
+/*
+ * Media emulation, for the blk-mq modes: a request completes from an
+ * hrtimer after latency_ns, plus a uniform random part up to
+ * latency_jitter_ns (at most a second), plus latency_tail_ns for
+ * latency_tail_pct percent of the requests. bandwidth_mb (MB/s) and
+ * iops cap what a device serves; requests beyond the caps wait their
+ * turn. All zero, the default, completes every request at once. Each
+ * parameter takes one value per device; a single value applies to all
+ * of them.
+ */
+#define SBULL_PARAM_DEVS 16
+static unsigned long latency_ns[SBULL_PARAM_DEVS];
+static unsigned long latency_jitter_ns[SBULL_PARAM_DEVS];
+static unsigned long latency_tail_ns[SBULL_PARAM_DEVS];
+static unsigned long latency_tail_pct[SBULL_PARAM_DEVS];
+static unsigned long bandwidth_mb[SBULL_PARAM_DEVS];
+static unsigned long iops[SBULL_PARAM_DEVS];
+static int nr_latency_ns, nr_latency_jitter_ns, nr_latency_tail_ns;
+static int nr_latency_tail_pct, nr_bandwidth_mb, nr_iops;
+module_param_array(latency_ns, ulong, &nr_latency_ns, 0);
+module_param_array(latency_jitter_ns, ulong, &nr_latency_jitter_ns, 0);
+module_param_array(latency_tail_ns, ulong, &nr_latency_tail_ns, 0);
+module_param_array(latency_tail_pct, ulong, &nr_latency_tail_pct, 0);
+module_param_array(bandwidth_mb, ulong, &nr_bandwidth_mb, 0);
+module_param_array(iops, ulong, &nr_iops, 0);
+
+/*
+ * A volatile write cache of write_cache_kb KiB, destaged to the media
+ * at destage_mb MB/s. Writes complete once they are in the cache, or
+ * wait for room in it; a flush waits until the cache is clean, a FUA
+ * write until it has gone through. Per device, as above.
+ */
+static unsigned long write_cache_kb[SBULL_PARAM_DEVS];
+static unsigned long destage_mb[SBULL_PARAM_DEVS] = { 100 };
+static int nr_write_cache_kb, nr_destage_mb = 1;
+module_param_array(write_cache_kb, ulong, &nr_write_cache_kb, 0);
+module_param_array(destage_mb, ulong, &nr_destage_mb, 0);
+
+/*
+ * Compressed storage: each page is compressed with comp_alg.
+ */
+static int compress = 0;
+module_param(compress, int, 0);
+static char *comp_alg = "lz4";
+module_param(comp_alg, charp, 0);
+
+/*
+ * Direct access: a char device per disk maps its memory.
+ */
+static int dax = 1;
+module_param(dax, int, 0);
+static int sbull_dax_major = 0;
+
+/*
+ * Zoned mode, for the blk-mq modes.
+ */
+static int zoned = 0;
+module_param(zoned, int, 0);
+static unsigned int zone_size = 64;	/* KiB, a power of two */
+module_param(zone_size, uint, 0);
+static unsigned int zone_count = 0;	/* 0: as many as fit in nsectors */
+module_param(zone_count, uint, 0);
+static unsigned int zone_nr_conv = 1;	/* conventional zones first */
+module_param(zone_nr_conv, uint, 0);
+static unsigned int zone_max_open = 0;	/* 0: no limit */
+module_param(zone_max_open, uint, 0);
+static unsigned int zone_max_active = 0;
+module_param(zone_max_active, uint, 0);
+
 /*
  * Minor number and partition management.
  */
@@ -66,68 +198,1130 @@ module_param(request_mode, int, 0);
 #define KERNEL_SECTOR_SIZE	512
 
 /*
- * After this much idle time, the driver will simulate a media change.
+ * After this much idle time, the driver will simulate a media change.
+ */
+#define INVALIDATE_DELAY	30*HZ
+
+/*
+ * A hardware queue. Requests on the poll queues are done right away
+ * like all the others, but wait on "list" until somebody polls for
+ * them, instead of being completed at once.
+ */
+struct sbull_queue {
+	spinlock_t lock;
+	struct list_head list;
+};
+
+/*
+ * A zone. Only sequential zones have a write pointer.
+ */
+struct sbull_zone {
+	sector_t start;
+	sector_t wp;
+	unsigned int type;		/* BLK_ZONE_TYPE_* */
+	unsigned int cond;		/* BLK_ZONE_COND_* */
+};
+
+/* the per-request data: how it went, until it is completed */
+struct sbull_cmd {
+	blk_status_t status;
+	ktime_t deadline;		/* when a polled request is due */
+	ktime_t start;			/* of a flush, for the statistics */
+	struct hrtimer timer;		/* when it is not */
+};
+
+/*
+ * The pages of a disk are kept in layers. A disk writes to its own top
+ * layer; a snapshot freezes the layer and puts a new, empty one on top
+ * of it, for the origin and for the snapshot alike. Reading a page
+ * looks through the layers, top first. A frozen layer is shared, and
+ * lives as long as a layer above it.
+ */
+struct sbull_layer {
+	struct xarray pages;
+	struct kref kref;
+	struct sbull_layer *below;
+};
+
+/*
+ * A page of the top layer that reads as zeros, whatever is below: a
+ * discard of a shared page leaves one.
+ */
+#define SBULL_WHITEOUT	xa_mk_value(0)
+
+/*
+ * The internal representation of our device.
+ */
+struct sbull_dev {
+        u64 size;                       /* Device size in bytes */
+        struct sbull_layer *top;        /* The data, a page at a time */
+        int readonly;                   /* A read-only snapshot */
+        int dying;                      /* Being removed */
+        short users;                    /* How many users */
+        short media_change;             /* Flag a media change? */
+        spinlock_t lock;                /* For mutual exclusion */
+	struct blk_mq_tag_set tag_set;	/* tag_set added */
+	struct sbull_queue *queues;	/* one per hardware queue */
+	int emulate;			/* any of the below is set */
+	u64 latency, jitter, tail;	/* nanoseconds */
+	unsigned int tail_pct;
+	u64 bandwidth;			/* bytes per second */
+	unsigned int iops;
+	spinlock_t rate_lock;		/* protects busy_until, the cache */
+	ktime_t busy_until;		/* when the "media" is free again */
+	u64 wc_size;			/* write cache, bytes */
+	u64 wc_rate;			/* destaged per second */
+	u64 wc_window;			/* the time to destage all of it */
+	ktime_t wc_clean;		/* when all is destaged */
+	unsigned long flushes;		/* flushes completed */
+	u64 flush_ns, flush_max_ns;	/* and their latency */
+	struct sbull_zone *zones;	/* in zoned mode */
+	unsigned int nr_zones;
+	sector_t zone_sectors;
+	unsigned int nr_open, nr_active;
+	spinlock_t zone_lock;		/* protects the zone state */
+	struct cdev dax_cdev;		/* direct access to the data */
+	atomic_t dax_maps;		/* its mappings: no snapshot then */
+	int dax_opens;			/* its open files: no drop then */
+	struct crypto_comp *tfm;	/* in compressed mode */
+	struct mutex zmutex;		/* protects all of the below */
+	void *zbuf, *zpage, *zero_page;
+	unsigned long zpages;		/* pages kept compressed */
+	unsigned long huge_pages;	/* of which didn't compress */
+	unsigned long same_pages;	/* pages of a single word */
+	u64 zbytes;			/* what they take */
+        struct request_queue *queue;    /* The device request queue */
+        struct gendisk *gd;             /* The gendisk structure */
+        struct timer_list timer;        /* For simulated media changes */
+};
+
+static struct sbull_dev *Devices = NULL;
+static DEFINE_MUTEX(sbull_snap_mutex);	/* serializes snapshots */
+
+/**
+* See https://github.com/openzfs/zfs/pull/10187/
+*/
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
+static inline struct request_queue *
+blk_generic_alloc_queue(make_request_fn make_request, int node_id)
+#else
+static inline struct request_queue *
+blk_generic_alloc_queue(int node_id)
+#endif
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0))
+	struct request_queue *q = blk_alloc_queue(GFP_KERNEL);
+	if (q != NULL)
+		blk_queue_make_request(q, make_request);
+
+	return (q);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
+	return (blk_alloc_queue(make_request, node_id));
+#else
+	return (blk_alloc_queue(node_id));
+#endif
+}
+
+static struct sbull_layer *sbull_new_layer(struct sbull_layer *below)
+{
+	struct sbull_layer *layer = kmalloc(sizeof(*layer), GFP_KERNEL);
+
+	if (!layer)
+		return NULL;
+	xa_init(&layer->pages);
+	kref_init(&layer->kref);
+	layer->below = below;
+	return layer;
+}
+
+static void sbull_release_layer(struct kref *kref)
+{
+	struct sbull_layer *layer = container_of(kref, struct sbull_layer, kref);
+	struct page *page;
+	unsigned long idx;
+
+	xa_for_each(&layer->pages, idx, page) {
+		if (!xa_is_value(page))
+			__free_page(page);
+		cond_resched();
+	}
+	xa_destroy(&layer->pages);
+	if (layer->below)
+		kref_put(&layer->below->kref, sbull_release_layer);
+	kfree(layer);
+}
+
+/*
+ * The page to read at index "idx", or NULL for zeros. Called under
+ * rcu_read_lock().
+ */
+static struct page *sbull_lookup(struct sbull_dev *dev, pgoff_t idx)
+{
+	struct sbull_layer *layer;
+	struct page *page = NULL;
+
+	for (layer = dev->top; layer && !page; layer = layer->below)
+		page = xa_load(&layer->pages, idx);
+	return xa_is_value(page) ? NULL : page;
+}
+
+/*
+ * The data lives in individual pages, indexed by their offset in the
+ * device, as in the brd ramdisk. A page is only allocated the first
+ * time something is written to it; until then it reads as zeros. So
+ * memory is only used for the parts of the disk in use, and the disk
+ * can be much larger than the memory, or the vmalloc area. Below a
+ * snapshot, the first write to a page copies it to the top layer.
+ */
+static struct page *sbull_insert_page(struct sbull_dev *dev, pgoff_t idx)
+{
+	struct xarray *pages = &dev->top->pages;
+	struct page *page, *cur, *old;
+
+	old = xa_load(pages, idx);
+	if (old && !xa_is_value(old))
+		return old;
+	page = alloc_page(GFP_NOIO | __GFP_ZERO | __GFP_NOWARN);
+	if (!page)
+		return NULL;
+	if (!old && dev->top->below) { /* copy on write */
+		struct page *src;
+
+		rcu_read_lock();
+		src = sbull_lookup(dev, idx);
+		if (src)
+			copy_highpage(page, src);
+		rcu_read_unlock();
+	}
+	xa_lock(pages);
+	cur = __xa_cmpxchg(pages, idx, old, page, GFP_NOIO);
+	xa_unlock(pages);
+	if (unlikely(cur != old)) { /* somebody was faster, or no memory */
+		__free_page(page);
+		page = xa_is_err(cur) || xa_is_value(cur) ? NULL : cur;
+	}
+	return page;
+}
+
+/*
+ * Allocate all the pages a write will touch. This may sleep, so it is
+ * done before sbull_transfer(), which may run atomically.
+ */
+static int sbull_prepare_write(struct sbull_dev *dev, sector_t sector,
+		unsigned long nsect)
+{
+	u64 offset = (u64)sector*KERNEL_SECTOR_SIZE;
+	u64 end = offset + nsect*KERNEL_SECTOR_SIZE;
+	pgoff_t idx;
+
+	if (dev->readonly)
+		return -EROFS;
+	if (end > dev->size || dev->tfm)
+		return 0; /* sbull_transfer() complains, or allocates */
+	for (idx = offset >> PAGE_SHIFT; idx < DIV_ROUND_UP_ULL(end, PAGE_SIZE); idx++)
+		if (!sbull_insert_page(dev, idx))
+			return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Compressed mode, for compressible data, as in zram: each page is
+ * kept compressed in a kmalloc()ed buffer, and expanded again when it
+ * is read. A page filled with one repeated word only keeps that word,
+ * and a page of zeros isn't kept at all. Pages that don't compress
+ * are kept as they are. A device has its own transform and buffers,
+ * serialized by zmutex, which also protects its page index in this
+ * mode.
+ */
+struct sbull_zpage {
+	unsigned int len;	/* 0: every word is "fill" */
+	unsigned long fill;
+	u8 data[];
+};
+#define SBULL_ZBUF_SIZE	(2 * PAGE_SIZE)	/* room for incompressible data */
+
+static int sbull_same_filled(const void *src, unsigned long *fill)
+{
+	const unsigned long *word = src;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(*word); i++)
+		if (word[i] != word[0])
+			return 0;
+	*fill = word[0];
+	return 1;
+}
+
+/* forget a stored page */
+static void sbull_zput(struct sbull_dev *dev, struct sbull_zpage *zp)
+{
+	if (!zp)
+		return;
+	if (!zp->len)
+		dev->same_pages--;
+	else {
+		dev->zpages--;
+		dev->zbytes -= zp->len;
+		if (zp->len == PAGE_SIZE)
+			dev->huge_pages--;
+	}
+	kfree(zp);
+}
+
+/*
+ * Store a page worth of data at index "idx".
+ */
+static int sbull_zstore(struct sbull_dev *dev, pgoff_t idx, const void *src)
+{
+	struct sbull_zpage *zp = NULL, *old;
+	unsigned int len = SBULL_ZBUF_SIZE;
+	unsigned long fill;
+	const void *data = dev->zbuf;
+
+	if (sbull_same_filled(src, &fill)) {
+		if (fill) {
+			zp = kmalloc(sizeof(*zp), GFP_NOIO | __GFP_NOWARN);
+			if (!zp)
+				return -ENOMEM;
+			zp->len = 0;
+			zp->fill = fill;
+		}
+	} else {
+		if (crypto_comp_compress(dev->tfm, src, PAGE_SIZE, dev->zbuf, &len) ||
+				len >= PAGE_SIZE) {
+			len = PAGE_SIZE; /* no gain: keep it as it is */
+			data = src;
+		}
+		zp = kmalloc(sizeof(*zp) + len, GFP_NOIO | __GFP_NOWARN);
+		if (!zp)
+			return -ENOMEM;
+		zp->len = len;
+		memcpy(zp->data, data, len);
+	}
+
+	old = zp ? xa_store(&dev->top->pages, idx, zp, GFP_NOIO) :
+			xa_erase(&dev->top->pages, idx);
+	if (xa_is_err(old)) {
+		kfree(zp);
+		return xa_err(old);
+	}
+	sbull_zput(dev, old);
+	if (!zp)
+		return 0;
+	if (!zp->len)
+		dev->same_pages++;
+	else {
+		dev->zpages++;
+		dev->zbytes += zp->len;
+		if (zp->len == PAGE_SIZE)
+			dev->huge_pages++;
+	}
+	return 0;
+}
+
+/*
+ * Expand the page at index "idx" into "dst".
+ */
+static int sbull_zload(struct sbull_dev *dev, pgoff_t idx, void *dst)
+{
+	struct sbull_zpage *zp = xa_load(&dev->top->pages, idx);
+	unsigned long *word = dst;
+	unsigned int i, len = PAGE_SIZE;
+
+	if (!zp)
+		memset(dst, 0, PAGE_SIZE);
+	else if (!zp->len)
+		for (i = 0; i < PAGE_SIZE / sizeof(*word); i++)
+			word[i] = zp->fill;
+	else if (zp->len == PAGE_SIZE)
+		memcpy(dst, zp->data, PAGE_SIZE);
+	else if (crypto_comp_decompress(dev->tfm, zp->data, zp->len, dst, &len) ||
+			len != PAGE_SIZE) {
+		printk(KERN_WARNING "sbull: can't expand page %lu\n", idx);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Change part of a page: expand it, modify, compress again. "data" is
+ * NULL to clear that part. Called with zmutex held.
+ */
+static int sbull_zmodify(struct sbull_dev *dev, pgoff_t idx, unsigned int off,
+		unsigned int len, const void *data)
+{
+	int err;
+
+	if (len == PAGE_SIZE)
+		return sbull_zstore(dev, idx, data ? data : dev->zero_page);
+	err = sbull_zload(dev, idx, dev->zpage);
+	if (err)
+		return err;
+	if (data)
+		memcpy(dev->zpage + off, data, len);
+	else
+		memset(dev->zpage + off, 0, len);
+	return sbull_zstore(dev, idx, dev->zpage);
+}
+
+static int sbull_ztransfer(struct sbull_dev *dev, u64 offset,
+		unsigned long nbytes, char *buffer, int write)
+{
+	unsigned int off, len;
+	pgoff_t idx;
+	int err = 0;
+
+	mutex_lock(&dev->zmutex);
+	while (nbytes) {
+		idx = offset >> PAGE_SHIFT;
+		off = offset & ~PAGE_MASK;
+		len = min_t(unsigned long, nbytes, PAGE_SIZE - off);
+		if (write)
+			err = sbull_zmodify(dev, idx, off, len, buffer);
+		else if (len == PAGE_SIZE)
+			err = sbull_zload(dev, idx, buffer);
+		else {
+			err = sbull_zload(dev, idx, dev->zpage);
+			memcpy(buffer, dev->zpage + off, len);
+		}
+		if (err)
+			break;
+		buffer += len;
+		offset += len;
+		nbytes -= len;
+	}
+	mutex_unlock(&dev->zmutex);
+	return err;
+}
+
+/*
+ * Compression is optional: without the algorithm, the device keeps
+ * plain pages.
+ */
+static void sbull_setup_compression(struct sbull_dev *dev)
+{
+	struct crypto_comp *tfm;
+
+	tfm = crypto_alloc_comp(comp_alg, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_NOTICE "sbull: no \"%s\" compression (%li)\n",
+				comp_alg, PTR_ERR(tfm));
+		return;
+	}
+	dev->zbuf = kmalloc(SBULL_ZBUF_SIZE, GFP_KERNEL);
+	dev->zpage = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!dev->zbuf || !dev->zpage) {
+		kfree(dev->zpage);
+		kfree(dev->zbuf);
+		crypto_free_comp(tfm);
+		return;
+	}
+	mutex_init(&dev->zmutex);
+	dev->zero_page = page_address(ZERO_PAGE(0));
+	dev->tfm = tfm;
+}
+
+static void sbull_cleanup_compression(struct sbull_dev *dev)
+{
+	if (!dev->tfm)
+		return;
+	crypto_free_comp(dev->tfm);
+	kfree(dev->zpage);
+	kfree(dev->zbuf);
+}
+
+/*
+ * Empty the disk: free the top layer's pages, and let go of the
+ * layers below.
+ */
+static void sbull_free_pages(struct sbull_dev *dev)
+{
+	struct sbull_layer *below;
+	struct page *page;
+	unsigned long idx;
+
+	if (!dev->top)
+		return;
+	if (dev->tfm)
+		mutex_lock(&dev->zmutex);
+	xa_for_each(&dev->top->pages, idx, page) {
+		if (dev->tfm)
+			sbull_zput(dev, (struct sbull_zpage *) page);
+		else if (!xa_is_value(page))
+			__free_page(page);
+		cond_resched();
+	}
+	xa_destroy(&dev->top->pages);
+	if (dev->tfm)
+		mutex_unlock(&dev->zmutex);
+	below = dev->top->below;
+	dev->top->below = NULL;
+	if (below)
+		kref_put(&below->kref, sbull_release_layer);
+}
+
+/*
+ * Discard and write-zeroes: free the whole pages in the range, and
+ * clear the parts of the pages at its ends. A transfer may still be
+ * using a page we take out, so the page is only freed after an RCU
+ * grace period; sbull_transfer() works under rcu_read_lock().
+ */
+static void sbull_free_page_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+static void sbull_zero_range(struct sbull_dev *dev, u64 offset, unsigned int len)
+{
+	struct page *page;
+
+	if (dev->tfm) {
+		sbull_zmodify(dev, offset >> PAGE_SHIFT, offset & ~PAGE_MASK,
+				len, NULL);
+		return;
+	}
+	if (dev->top->below) { /* the page may be shared: copy it first */
+		page = sbull_insert_page(dev, offset >> PAGE_SHIFT);
+		if (page)
+			memset(page_address(page) + (offset & ~PAGE_MASK), 0, len);
+		return;
+	}
+	rcu_read_lock();
+	page = xa_load(&dev->top->pages, offset >> PAGE_SHIFT);
+	if (page && !xa_is_value(page))
+		memset(page_address(page) + (offset & ~PAGE_MASK), 0, len);
+	rcu_read_unlock();
+}
+
+/*
+ * Hide the pages of the layers below in [first, last].
+ */
+static int sbull_whiteout(struct sbull_dev *dev, unsigned long first,
+		unsigned long last)
+{
+	struct sbull_layer *layer;
+	struct page *page;
+	unsigned long idx;
+
+	for (layer = dev->top->below; layer; layer = layer->below) {
+		idx = first;
+		while ((page = xa_find(&layer->pages, &idx, last, XA_PRESENT))) {
+			if (!xa_is_value(page) && xa_is_err(xa_store(&dev->top->pages,
+					idx, SBULL_WHITEOUT, GFP_NOIO)))
+				return -ENOMEM;
+			if (idx++ == last)
+				break;
+			cond_resched();
+		}
+	}
+	return 0;
+}
+
+static int sbull_discard(struct sbull_dev *dev, sector_t sector,
+		unsigned long nsect)
+{
+	u64 offset = (u64)sector*KERNEL_SECTOR_SIZE;
+	u64 end = offset + (u64)nsect*KERNEL_SECTOR_SIZE;
+	unsigned long idx, last;
+	struct page *page;
+	int err = 0;
+
+	if (dev->readonly)
+		return -EROFS;
+	if (end > dev->size)
+		return -EIO;
+	if (dev->tfm) /* compressed pages aren't used in place: no RCU */
+		mutex_lock(&dev->zmutex);
+	if (offset & ~PAGE_MASK) { /* the head of the first page stays */
+		u64 next = min_t(u64, round_up(offset + 1, PAGE_SIZE), end);
+
+		sbull_zero_range(dev, offset, next - offset);
+		offset = next;
+	}
+	if ((end & ~PAGE_MASK) && end > offset) { /* and the tail of the last */
+		sbull_zero_range(dev, round_down(end, PAGE_SIZE), end & ~PAGE_MASK);
+		end = round_down(end, PAGE_SIZE);
+	}
+	if (end <= offset)
+		goto out;
+
+	/* only visit the pages that exist: the range may be huge */
+	idx = offset >> PAGE_SHIFT;
+	last = (end >> PAGE_SHIFT) - 1;
+	while ((page = xa_find(&dev->top->pages, &idx, last, XA_PRESENT))) {
+		xa_erase(&dev->top->pages, idx);
+		if (dev->tfm)
+			sbull_zput(dev, (struct sbull_zpage *) page);
+		else if (!xa_is_value(page))
+			call_rcu(&page->rcu_head, sbull_free_page_rcu);
+		if (idx++ == last)
+			break;
+		cond_resched();
+	}
+	if (dev->top->below)
+		err = sbull_whiteout(dev, offset >> PAGE_SHIFT, last);
+  out:
+	if (dev->tfm)
+		mutex_unlock(&dev->zmutex);
+	return err;
+}
+
+/*
+ * The copy for a transfer that is part of one of "bytes" bytes.
+ */
+static int sbull_copy_mode(int write, unsigned int bytes)
+{
+	if (bytes < READ_ONCE(copy_min))
+		return SBULL_COPY_MEMCPY;
+	return write ? READ_ONCE(copy_write) : READ_ONCE(copy_read);
+}
+
+#ifdef SBULL_VECTOR
+/*
+ * Loads and non-temporal stores of 64 bytes at a time, through the SSE
+ * registers, as the raid6 code does: the destination is aligned first.
+ */
+static void sbull_copy_vector(void *dst, const void *src, size_t len)
+{
+	size_t head = min_t(size_t, -(unsigned long) dst & 15, len);
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+	kernel_fpu_begin();
+	for (; len >= 64; len -= 64, dst += 64, src += 64)
+		asm volatile("movdqu    (%0), %%xmm0\n\t"
+			     "movdqu  16(%0), %%xmm1\n\t"
+			     "movdqu  32(%0), %%xmm2\n\t"
+			     "movdqu  48(%0), %%xmm3\n\t"
+			     "movntdq %%xmm0,   (%1)\n\t"
+			     "movntdq %%xmm1, 16(%1)\n\t"
+			     "movntdq %%xmm2, 32(%1)\n\t"
+			     "movntdq %%xmm3, 48(%1)\n\t"
+			     : : "r" (src), "r" (dst) : "memory");
+	kernel_fpu_end();
+	memcpy(dst, src, len);
+}
+#endif
+
+static void sbull_copy(void *dst, const void *src, size_t len, int mode)
+{
+	switch (mode) {
+	    case SBULL_COPY_VECTOR:
+#ifdef SBULL_VECTOR
+		sbull_copy_vector(dst, src, len);
+		wmb(); /* non-temporal stores are weakly ordered */
+		break;
+#endif
+		/* fall through */
+	    case SBULL_COPY_NT:
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0))
+		memcpy_flushcache(dst, src, len);
+		wmb();
+		break;
+#endif
+		/* fall through */
+	    default:
+		memcpy(dst, src, len);
+	}
+}
+
+/*
+ * Handle an I/O request.
+ */
+static int sbull_transfer(struct sbull_dev *dev, sector_t sector,
+		unsigned long nsect, char *buffer, int write, int copy)
+{
+	u64 offset = (u64)sector*KERNEL_SECTOR_SIZE;
+	unsigned long nbytes = nsect*KERNEL_SECTOR_SIZE;
+	unsigned int off, len;
+	struct page *page;
+
+	if ((offset + nbytes) > dev->size) {
+		printk (KERN_NOTICE "Beyond-end write (%lld %ld)\n", offset, nbytes);
+		return -EIO;
+	}
+	if (dev->tfm)
+		return sbull_ztransfer(dev, offset, nbytes, buffer, write);
+	rcu_read_lock(); /* against sbull_discard() */
+	while (nbytes) {
+		off = offset & ~PAGE_MASK;
+		len = min_t(unsigned long, nbytes, PAGE_SIZE - off);
+		if (write) {
+			page = xa_load(&dev->top->pages, offset >> PAGE_SHIFT);
+			if (!page || xa_is_value(page)) { /* discarded under our feet */
+				rcu_read_unlock();
+				return -EIO;
+			}
+			sbull_copy(page_address(page) + off, buffer, len, copy);
+		} else if ((page = sbull_lookup(dev, offset >> PAGE_SHIFT)))
+			sbull_copy(buffer, page_address(page) + off, len, copy);
+		else
+			memset(buffer, 0, len);
+		buffer += len;
+		offset += len;
+		nbytes -= len;
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/*
+ * Zoned mode: the disk is cut in zones of zone_size KiB. The first
+ * zone_nr_conv zones are conventional, the others must be written
+ * sequentially, at their write pointer, and are managed with the zone
+ * operations, as on an SMR disk or a ZNS SSD. A reset gives the memory
+ * of the zone back.
+ */
+#if defined(CONFIG_BLK_DEV_ZONED) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+#define SBULL_ZONED
+
+static inline struct sbull_zone *sbull_zone(struct sbull_dev *dev, sector_t sector)
+{
+	return dev->zones + (sector >> ilog2(dev->zone_sectors));
+}
+
+static inline int sbull_zone_is_open(unsigned int cond)
+{
+	return cond == BLK_ZONE_COND_IMP_OPEN || cond == BLK_ZONE_COND_EXP_OPEN;
+}
+
+static inline int sbull_zone_is_active(unsigned int cond)
+{
+	return sbull_zone_is_open(cond) || cond == BLK_ZONE_COND_CLOSED;
+}
+
+/*
+ * Change the condition of a zone, keeping the open and active counts.
+ * All the zone state is protected by zone_lock.
+ */
+static void sbull_zone_set_cond(struct sbull_dev *dev, struct sbull_zone *zone,
+		unsigned int cond)
+{
+	dev->nr_open += sbull_zone_is_open(cond) - sbull_zone_is_open(zone->cond);
+	dev->nr_active += sbull_zone_is_active(cond) -
+			sbull_zone_is_active(zone->cond);
+	zone->cond = cond;
+}
+
+static void sbull_zone_close(struct sbull_dev *dev, struct sbull_zone *zone)
+{
+	sbull_zone_set_cond(dev, zone, zone->wp == zone->start ?
+			BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED);
+}
+
+/*
+ * Open a zone, if the limits allow it. An implicit open may close
+ * another implicitly open zone to make room, as a real drive does.
+ */
+static blk_status_t sbull_zone_open(struct sbull_dev *dev,
+		struct sbull_zone *zone, unsigned int cond)
+{
+	unsigned int i;
+
+	if (sbull_zone_is_open(zone->cond)) {
+		if (cond == BLK_ZONE_COND_EXP_OPEN)
+			sbull_zone_set_cond(dev, zone, cond);
+		return BLK_STS_OK;
+	}
+	if (!sbull_zone_is_active(zone->cond) && zone_max_active &&
+			dev->nr_active >= zone_max_active)
+		return BLK_STS_ZONE_ACTIVE_RESOURCE;
+	if (zone_max_open && dev->nr_open >= zone_max_open) {
+		if (cond == BLK_ZONE_COND_EXP_OPEN)
+			return BLK_STS_ZONE_OPEN_RESOURCE;
+		for (i = 0; i < dev->nr_zones; i++)
+			if (dev->zones[i].cond == BLK_ZONE_COND_IMP_OPEN)
+				break;
+		if (i == dev->nr_zones)
+			return BLK_STS_ZONE_OPEN_RESOURCE;
+		sbull_zone_close(dev, dev->zones + i);
+	}
+	sbull_zone_set_cond(dev, zone, cond);
+	return BLK_STS_OK;
+}
+
+/*
+ * A write must start at the write pointer and stay in its zone; a zone
+ * append goes to the write pointer, wherever that is, and the request
+ * is moved there so that the caller learns where its data went.
+ */
+static blk_status_t sbull_zone_write(struct sbull_dev *dev, struct request *req)
+{
+	struct sbull_zone *zone = sbull_zone(dev, blk_rq_pos(req));
+	unsigned int nsect = blk_rq_sectors(req);
+	int append = req_op(req) == REQ_OP_ZONE_APPEND;
+	blk_status_t ret;
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return append ? BLK_STS_IOERR : BLK_STS_OK;
+
+	spin_lock(&dev->zone_lock);
+	if (zone->cond == BLK_ZONE_COND_FULL ||
+			(!append && blk_rq_pos(req) != zone->wp) ||
+			zone->wp + nsect > zone->start + dev->zone_sectors) {
+		ret = BLK_STS_IOERR;
+		goto out;
+	}
+	ret = sbull_zone_open(dev, zone, BLK_ZONE_COND_IMP_OPEN);
+	if (ret != BLK_STS_OK)
+		goto out;
+	if (append) {
+		req->__sector = zone->wp;
+		req->bio->bi_iter.bi_sector = zone->wp;
+	}
+	zone->wp += nsect;
+	if (zone->wp == zone->start + dev->zone_sectors)
+		sbull_zone_set_cond(dev, zone, BLK_ZONE_COND_FULL);
+  out:
+	spin_unlock(&dev->zone_lock);
+	return ret;
+}
+
+/*
+ * The data of a write that sbull_zone_write() let through could not be
+ * stored: give its sectors back, unless something was written after
+ * them, or the zone, filled by it, can't be opened again within the
+ * limits. As on a real drive, the write pointer then stays where it is.
+ */
+static void sbull_zone_write_failed(struct sbull_dev *dev,
+		struct request *req)
+{
+	struct sbull_zone *zone = sbull_zone(dev, blk_rq_pos(req));
+	sector_t end = blk_rq_pos(req) + blk_rq_sectors(req);
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL ||
+			!op_is_write(req_op(req)))
+		return;
+	spin_lock(&dev->zone_lock);
+	if (zone->wp == end && (zone->cond != BLK_ZONE_COND_FULL ||
+			sbull_zone_open(dev, zone, BLK_ZONE_COND_IMP_OPEN) ==
+			BLK_STS_OK)) {
+		zone->wp = blk_rq_pos(req);
+		if (zone->wp == zone->start)
+			sbull_zone_close(dev, zone); /* empty again */
+	}
+	spin_unlock(&dev->zone_lock);
+}
+
+static void sbull_zone_reset(struct sbull_dev *dev, struct sbull_zone *zone)
+{
+	sbull_zone_set_cond(dev, zone, BLK_ZONE_COND_EMPTY);
+	zone->wp = zone->start;
+}
+
+/*
+ * Open, close, finish and reset.
+ */
+static blk_status_t sbull_zone_mgmt(struct sbull_dev *dev, unsigned int op,
+		sector_t sector)
+{
+	struct sbull_zone *zone;
+	blk_status_t ret = BLK_STS_OK;
+	unsigned int i;
+
+	if (op == REQ_OP_ZONE_RESET_ALL) {
+		spin_lock(&dev->zone_lock);
+		for (i = zone_nr_conv; i < dev->nr_zones; i++)
+			sbull_zone_reset(dev, dev->zones + i);
+		spin_unlock(&dev->zone_lock);
+		sbull_discard(dev, zone_nr_conv * dev->zone_sectors,
+				(dev->nr_zones - zone_nr_conv) * dev->zone_sectors);
+		return BLK_STS_OK;
+	}
+
+	zone = sbull_zone(dev, sector);
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return BLK_STS_IOERR;
+	spin_lock(&dev->zone_lock);
+	switch (op) {
+	    case REQ_OP_ZONE_OPEN:
+		if (zone->cond != BLK_ZONE_COND_FULL)
+			ret = sbull_zone_open(dev, zone, BLK_ZONE_COND_EXP_OPEN);
+		break;
+	    case REQ_OP_ZONE_CLOSE:
+		if (sbull_zone_is_open(zone->cond))
+			sbull_zone_close(dev, zone);
+		break;
+	    case REQ_OP_ZONE_FINISH:
+		sbull_zone_set_cond(dev, zone, BLK_ZONE_COND_FULL);
+		zone->wp = zone->start + dev->zone_sectors;
+		break;
+	    case REQ_OP_ZONE_RESET:
+		sbull_zone_reset(dev, zone);
+		break;
+	    default:
+		ret = BLK_STS_NOTSUPP;
+	}
+	spin_unlock(&dev->zone_lock);
+	if (op == REQ_OP_ZONE_RESET)
+		sbull_discard(dev, zone->start, dev->zone_sectors);
+	return ret;
+}
+
+/*
+ * The zone side of a request. Returns false when the request needs
+ * nothing more, with its status in *status.
+ */
+static bool sbull_zone_request(struct sbull_dev *dev, struct request *req,
+		blk_status_t *status)
+{
+	if (op_is_zone_mgmt(req_op(req))) {
+		*status = sbull_zone_mgmt(dev, req_op(req), blk_rq_pos(req));
+		return false;
+	}
+	if (op_is_write(req_op(req))) {
+		*status = sbull_zone_write(dev, req);
+		return *status == BLK_STS_OK;
+	}
+	return true;
+}
+
+static int sbull_report_zones(struct gendisk *disk, sector_t sector,
+		unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+	struct sbull_dev *dev = disk->private_data;
+	struct sbull_zone *zone;
+	struct blk_zone blkz;
+	unsigned int i, first = sector >> ilog2(dev->zone_sectors);
+	int err;
+
+	for (i = 0; i < nr_zones && first + i < dev->nr_zones; i++) {
+		zone = dev->zones + first + i;
+		memset(&blkz, 0, sizeof(blkz));
+		blkz.start = zone->start;
+		blkz.len = blkz.capacity = dev->zone_sectors;
+		blkz.type = zone->type;
+		spin_lock(&dev->zone_lock);
+		blkz.cond = zone->cond;
+		blkz.wp = zone->wp;
+		spin_unlock(&dev->zone_lock);
+		err = cb(&blkz, i, data);
+		if (err)
+			return err;
+	}
+	return i;
+}
+
+/*
+ * Cut the disk in zones: zone_count of them if given, otherwise as
+ * many as fit in its size.
+ */
+static int sbull_setup_zones(struct sbull_dev *dev)
+{
+	unsigned int i;
+
+	dev->zone_sectors = zone_size * 1024 / KERNEL_SECTOR_SIZE;
+	if (zone_count)
+		dev->size = (u64)zone_count * zone_size * 1024;
+	dev->nr_zones = div_u64(dev->size, zone_size * 1024);
+	dev->size = (u64)dev->nr_zones * zone_size * 1024;
+	if (dev->nr_zones <= zone_nr_conv) {
+		printk(KERN_NOTICE "sbull: no room for sequential zones\n");
+		return -EINVAL;
+	}
+	dev->zones = kvcalloc(dev->nr_zones, sizeof(*dev->zones), GFP_KERNEL);
+	if (!dev->zones)
+		return -ENOMEM;
+	spin_lock_init(&dev->zone_lock);
+	for (i = 0; i < dev->nr_zones; i++) {
+		struct sbull_zone *zone = dev->zones + i;
+
+		zone->start = zone->wp = (sector_t)i * dev->zone_sectors;
+		if (i < zone_nr_conv) {
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+			zone->wp = (sector_t)-1;
+		} else {
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Tell the block layer, once the disk is set up, before adding it.
+ */
+static int sbull_register_zones(struct sbull_dev *dev)
+{
+	struct request_queue *q = dev->queue;
+
+	blk_queue_set_zoned(dev->gd, BLK_ZONED_HM);
+	blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, q);
+	blk_queue_required_elevator_features(q, ELEVATOR_F_ZBD_SEQ_WRITE);
+	blk_queue_chunk_sectors(q, dev->zone_sectors);
+	blk_queue_max_zone_append_sectors(q, dev->zone_sectors);
+	blk_queue_max_open_zones(q, zone_max_open);
+	blk_queue_max_active_zones(q, zone_max_active);
+	return blk_revalidate_disk_zones(dev->gd, NULL);
+}
+
+#else /* no zoned block devices */
+
+static bool sbull_zone_request(struct sbull_dev *dev, struct request *req,
+		blk_status_t *status)
+{
+	return true;
+}
+
+static void sbull_zone_write_failed(struct sbull_dev *dev,
+		struct request *req)
+{
+}
+
+static int sbull_setup_zones(struct sbull_dev *dev)
+{
+	printk(KERN_NOTICE "sbull: this kernel has no zoned block devices\n");
+	return -EINVAL;
+}
+
+static int sbull_register_zones(struct sbull_dev *dev)
+{
+	return -EINVAL;
+}
+#endif /* SBULL_ZONED */
+
+/*
+ * When the write cache lets "req" complete. Destaging is first in,
+ * first out, so the cache is just the time at which it will be clean:
+ * the dirty data is what can be destaged until then. Called with the
+ * rate_lock held.
+ */
+static ktime_t sbull_cache_wait(struct sbull_dev *dev, struct request *req,
+		ktime_t now)
+{
+	ktime_t clean = ktime_after(dev->wc_clean, now) ? dev->wc_clean : now;
+	int data = rq_data_dir(req) == WRITE && req->bio && bio_has_data(req->bio);
+
+	if (data)
+		clean = ktime_add_ns(clean, div64_u64((u64) blk_rq_bytes(req) *
+				NSEC_PER_SEC, dev->wc_rate));
+	dev->wc_clean = clean;
+	if (req_op(req) == REQ_OP_FLUSH || (req->cmd_flags & REQ_FUA))
+		return clean; /* all of it, up to this request */
+	if (data)
+		return ktime_sub_ns(clean, dev->wc_window); /* room for it */
+	return now; /* reads don't go through the cache */
+}
+
+/*
+ * When an emulated request is due. The device serves one request after
+ * the other, each taking the time its size and the caps allow, so a
+ * request may have to wait for the ones before it; then comes the
+ * latency. A write cache can hold a request back, too.
  */
-#define INVALIDATE_DELAY	30*HZ
+static ktime_t sbull_deadline(struct sbull_dev *dev, struct request *req)
+{
+	ktime_t now = ktime_get(), done = now;
+	u64 service = 0, latency = dev->latency;
+
+	if (dev->bandwidth && (req_op(req) == REQ_OP_READ ||
+				req_op(req) == REQ_OP_WRITE))
+		service = div64_u64((u64) blk_rq_bytes(req) * NSEC_PER_SEC,
+				dev->bandwidth);
+	if (dev->iops)
+		service = max_t(u64, service, NSEC_PER_SEC / dev->iops);
+	if (service) {
+		spin_lock(&dev->rate_lock);
+		if (ktime_after(dev->busy_until, now))
+			done = dev->busy_until;
+		done = ktime_add_ns(done, service);
+		dev->busy_until = done;
+		spin_unlock(&dev->rate_lock);
+	}
+	if (dev->wc_size) {
+		ktime_t clean;
+
+		spin_lock(&dev->rate_lock);
+		clean = sbull_cache_wait(dev, req, now);
+		spin_unlock(&dev->rate_lock);
+		if (ktime_after(clean, done))
+			done = clean;
+	}
+
+	if (dev->jitter)
+		latency += get_random_u32() % (u32) (dev->jitter + 1);
+	if (dev->tail_pct && get_random_u32() % 100 < dev->tail_pct)
+		latency += dev->tail;
+	return ktime_add_ns(done, latency);
+}
+
+static enum hrtimer_restart sbull_timer_fn(struct hrtimer *timer)
+{
+	struct sbull_cmd *cmd = container_of(timer, struct sbull_cmd, timer);
+
+	/* the rest happens in the block softirq, in sbull_complete() */
+	blk_mq_complete_request(blk_mq_rq_from_pdu(cmd));
+	return HRTIMER_NORESTART;
+}
 
 /*
- * The internal representation of our device.
+ * Complete a request, counting the flushes.
  */
-struct sbull_dev {
-        int size;                       /* Device size in sectors */
-        u8 *data;                       /* The data array */
-        short users;                    /* How many users */
-        short media_change;             /* Flag a media change? */
-        spinlock_t lock;                /* For mutual exclusion */
-	struct blk_mq_tag_set tag_set;	/* tag_set added */
-        struct request_queue *queue;    /* The device request queue */
-        struct gendisk *gd;             /* The gendisk structure */
-        struct timer_list timer;        /* For simulated media changes */
-};
+static void sbull_finish(struct request *req, blk_status_t status)
+{
+	struct sbull_dev *dev = req->q->queuedata;
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+	u64 ns;
+
+	if (req_op(req) == REQ_OP_FLUSH) {
+		ns = ktime_to_ns(ktime_sub(ktime_get(), cmd->start));
+		spin_lock(&dev->rate_lock);
+		dev->flushes++;
+		dev->flush_ns += ns;
+		dev->flush_max_ns = max(dev->flush_max_ns, ns);
+		spin_unlock(&dev->rate_lock);
+	}
+	blk_mq_end_request(req, status);
+}
 
-static struct sbull_dev *Devices = NULL;
+static void sbull_complete(struct request *req)
+{
+	sbull_finish(req, ((struct sbull_cmd *) blk_mq_rq_to_pdu(req))->status);
+}
 
-/**
-* See https://github.com/openzfs/zfs/pull/10187/
-*/
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
-static inline struct request_queue *
-blk_generic_alloc_queue(make_request_fn make_request, int node_id)
-#else
-static inline struct request_queue *
-blk_generic_alloc_queue(int node_id)
-#endif
+static int sbull_init_request(struct blk_mq_tag_set *set, struct request *req,
+		unsigned int hctx_idx, unsigned int numa_node)
 {
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0))
-	struct request_queue *q = blk_alloc_queue(GFP_KERNEL);
-	if (q != NULL)
-		blk_queue_make_request(q, make_request);
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
 
-	return (q);
-#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
-	return (blk_alloc_queue(make_request, node_id));
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 15, 0))
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	cmd->timer.function = sbull_timer_fn;
 #else
-	return (blk_alloc_queue(node_id));
+	hrtimer_setup(&cmd->timer, sbull_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 #endif
+	return 0;
 }
 
 /*
- * Handle an I/O request.
+ * The end of a request: at once, from the timer when emulating the
+ * media, or when polled on a poll queue. Either way queue_rq()
+ * succeeded, as the request is taken care of.
  */
-static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
-		unsigned long nsect, char *buffer, int write)
+static blk_status_t sbull_end_request(struct blk_mq_hw_ctx *hctx,
+		struct request *req, blk_status_t status)
 {
-	unsigned long offset = sector*KERNEL_SECTOR_SIZE;
-	unsigned long nbytes = nsect*KERNEL_SECTOR_SIZE;
-
-	if ((offset + nbytes) > dev->size) {
-		printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
-		return;
-	}
-	if (write)
-		memcpy(dev->data + offset, buffer, nbytes);
+	struct sbull_queue *sq = hctx->driver_data;
+	struct sbull_dev *dev = req->q->queuedata;
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->status = status;
+	if (req_op(req) == REQ_OP_FLUSH)
+		cmd->start = ktime_get(); /* no data, so no time was spent */
+	if (hctx->type == HCTX_TYPE_POLL) {
+		cmd->deadline = dev->emulate ? sbull_deadline(dev, req) : 0;
+		spin_lock(&sq->lock);
+		list_add_tail(&req->queuelist, &sq->list);
+		spin_unlock(&sq->lock);
+	} else if (dev->emulate)
+		hrtimer_start(&cmd->timer, sbull_deadline(dev, req),
+				HRTIMER_MODE_ABS);
 	else
-		memcpy(buffer, dev->data + offset, nbytes);
+		sbull_finish(req, status);
+	return BLK_STS_OK;
 }
 
 /*
@@ -143,6 +1337,8 @@ static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx, const struct blk_m
         sector_t pos_sector = blk_rq_pos(req);
 	void	*buffer;
 	blk_status_t  ret;
+	int	write = rq_data_dir(req) == WRITE;
+	int	copy = sbull_copy_mode(write, blk_rq_bytes(req));
 
 	blk_mq_start_request (req);
 
@@ -151,46 +1347,167 @@ static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx, const struct blk_m
                 ret = BLK_STS_IOERR;  //-EIO
 			goto done;
 	}
+	if (dev->zones) {
+		if (!sbull_zone_request(dev, req, &ret))
+			goto done;
+		pos_sector = blk_rq_pos(req); /* a zone append moves */
+	}
+	if (req_op(req) == REQ_OP_DISCARD || req_op(req) == REQ_OP_WRITE_ZEROES) {
+		ret = errno_to_blk_status(sbull_discard(dev, pos_sector,
+				blk_rq_sectors(req)));
+		goto done;
+	}
 	rq_for_each_segment(bvec, req, iter)
 	{
-		size_t num_sector = blk_rq_cur_sectors(req);
-		printk (KERN_NOTICE "Req dev %u dir %d sec %lld, nr %ld\n",
+		size_t num_sector = bvec.bv_len / KERNEL_SECTOR_SIZE;
+		pr_debug("Req dev %u dir %d sec %lld, nr %ld\n",
                         (unsigned)(dev - Devices), rq_data_dir(req),
                         pos_sector, num_sector);
 		buffer = page_address(bvec.bv_page) + bvec.bv_offset;
-		sbull_transfer(dev, pos_sector, num_sector,
-				buffer, rq_data_dir(req) == WRITE);
+		if ((write && sbull_prepare_write(dev, pos_sector, num_sector)) ||
+				sbull_transfer(dev, pos_sector, num_sector,
+				buffer, write, copy)) {
+			if (dev->zones)
+				sbull_zone_write_failed(dev, req);
+			ret = BLK_STS_IOERR;
+			goto done;
+		}
 		pos_sector += num_sector;
 	}
 	ret = BLK_STS_OK;
 done:
-	blk_mq_end_request (req, ret);
-	return ret;
+	return sbull_end_request(hctx, req, ret);
 }
 
 
 /*
  * Transfer a single BIO.
  */
-static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
+static int sbull_xfer_segments(struct sbull_dev *dev, struct bio *bio,
+		struct bvec_iter start)
 {
 	struct bio_vec bvec;
 	struct bvec_iter iter;
-	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t sector = start.bi_sector;
+	int write = bio_data_dir(bio) == WRITE;
+	int copy = sbull_copy_mode(write, bio->bi_iter.bi_size);
+	int err;
 
 	/* Do each segment independently. */
-	bio_for_each_segment(bvec, bio, iter) {
+	__bio_for_each_segment(bvec, bio, iter, start) {
 		//char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-		char *buffer = kmap_atomic(bvec.bv_page) + bvec.bv_offset;
+		char *buffer;
+		unsigned long nsect = bvec.bv_len / KERNEL_SECTOR_SIZE;
+
+		/* the allocation may sleep: do it before the transfer */
+		if (write && sbull_prepare_write(dev, sector, nsect))
+			return -ENOMEM;
+		/* compressed transfers sleep: no atomic mapping */
+		buffer = kmap(bvec.bv_page) + bvec.bv_offset;
 		//sbull_transfer(dev, sector, bio_cur_bytes(bio) >> 9,
-		sbull_transfer(dev, sector, (bio_cur_bytes(bio) / KERNEL_SECTOR_SIZE),
-				buffer, bio_data_dir(bio) == WRITE);
+		err = sbull_transfer(dev, sector, nsect, buffer, write, copy);
 		//sector += bio_cur_bytes(bio) >> 9;
-		sector += (bio_cur_bytes(bio) / KERNEL_SECTOR_SIZE);
+		sector += nsect;
 		//__bio_kunmap_atomic(buffer, KM_USER0);
-		kunmap_atomic(buffer);
+		kunmap(bvec.bv_page);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
+{
+	/* no data: just a range */
+	if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
+		return sbull_discard(dev, bio->bi_iter.bi_sector, bio_sectors(bio));
+	return sbull_xfer_segments(dev, bio, bio->bi_iter);
+}
+
+/*
+ * A large bio, copied in parallel: each chunk is a range of the bio's
+ * segments, and the bio ends with the last of them. The bio holds a
+ * reference on the queue until then, so that freezing the queue (for
+ * a snapshot) waits for it, as it would for a request.
+ */
+struct sbull_chunk {
+	struct work_struct work;
+	struct sbull_pio *pio;
+	struct bvec_iter iter;		/* the part of the bio to copy */
+};
+
+struct sbull_pio {
+	struct bio *bio;
+	struct sbull_dev *dev;
+	atomic_t pending;		/* chunks not copied yet */
+	int error;
+	struct sbull_chunk chunks[];
+};
+
+static void sbull_chunk_work(struct work_struct *work)
+{
+	struct sbull_chunk *chunk = container_of(work, struct sbull_chunk, work);
+	struct sbull_pio *pio = chunk->pio;
+	struct request_queue *q = pio->dev->queue;
+	int err;
+
+	err = sbull_xfer_segments(pio->dev, pio->bio, chunk->iter);
+	if (err)
+		cmpxchg(&pio->error, 0, err);
+	if (!atomic_dec_and_test(&pio->pending))
+		return;
+	pio->bio->bi_status = errno_to_blk_status(pio->error);
+	bio_endio(pio->bio);
+	kfree(pio);
+	percpu_ref_put(&q->q_usage_counter);
+}
+
+/*
+ * Start copying "bio" in parallel, if it is worth it. The submitting
+ * CPU takes the last chunk itself.
+ */
+static bool sbull_xfer_parallel(struct sbull_dev *dev, struct bio *bio)
+{
+	unsigned int size = bio->bi_iter.bi_size, chunk, n, i;
+	int min_kb = READ_ONCE(parallel_kb);
+	int chunk_kb = READ_ONCE(parallel_chunk_kb);
+	struct bvec_iter iter = bio->bi_iter;
+	struct sbull_pio *pio;
+
+	/* compressed transfers go one at a time anyway */
+	if (!sbull_wq || dev->tfm || !bio_has_data(bio) ||
+			bio_op(bio) == REQ_OP_DISCARD ||
+			bio_op(bio) == REQ_OP_WRITE_ZEROES)
+		return false;
+	/* the parameters may be anything: no overflow in KiB to bytes */
+	if (min_kb <= 0 || size < (u64)min_kb * 1024)
+		return false;
+	chunk = min_t(u64, (u64)max(chunk_kb, 4) * 1024, size);
+	n = DIV_ROUND_UP(size, chunk);
+	if (n < 2)
+		return false;
+	pio = kmalloc(sizeof(*pio) + n * sizeof(pio->chunks[0]), GFP_NOIO);
+	if (!pio)
+		return false;
+	pio->bio = bio;
+	pio->dev = dev;
+	pio->error = 0;
+	atomic_set(&pio->pending, n);
+	percpu_ref_get(&dev->queue->q_usage_counter);
+	for (i = 0; i < n; i++) {
+		struct sbull_chunk *c = pio->chunks + i;
+
+		INIT_WORK(&c->work, sbull_chunk_work);
+		c->pio = pio;
+		c->iter = iter;
+		c->iter.bi_size = min(chunk, iter.bi_size);
+		bio_advance_iter(bio, &iter, c->iter.bi_size);
+		if (i < n - 1)
+			queue_work(sbull_wq, &c->work);
+		else
+			sbull_chunk_work(&c->work);
 	}
-	return 0; /* Always "succeed" */
+	return true;
 }
 
 /*
@@ -202,7 +1519,8 @@ static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 	int nsect = 0;
     
 	__rq_for_each_bio(bio, req) {
-		sbull_xfer_bio(dev, bio);
+		if (sbull_xfer_bio(dev, bio))
+			return -EIO;
 		//nsect += bio->bi_size/KERNEL_SECTOR_SIZE;
 		nsect += bio->bi_iter.bi_size/KERNEL_SECTOR_SIZE;
 	}
@@ -233,13 +1551,16 @@ static blk_status_t sbull_full_request(struct blk_mq_hw_ctx * hctx, const struct
 			//continue;
 			goto done;
 		}
+		if (dev->zones && !sbull_zone_request(dev, req, &ret))
+			goto done;
 		sectors_xferred = sbull_xfer_request(dev, req);
-		ret = BLK_STS_OK; 
+		ret = sectors_xferred < 0 ? BLK_STS_IOERR : BLK_STS_OK;
+		if (ret != BLK_STS_OK && dev->zones)
+			sbull_zone_write_failed(dev, req);
 	done:
 		//__blk_end_request(req, 0, sectors_xferred);
-		blk_mq_end_request (req, ret);
 	//}
-	return ret;
+	return sbull_end_request(hctx, req, ret);
 }
 
 
@@ -258,8 +1579,10 @@ static blk_qc_t sbull_make_request(struct bio *bio)
 	struct sbull_dev *dev = bio->bi_disk->private_data;
 	int status;
 
+	if (sbull_xfer_parallel(dev, bio))
+		return BLK_QC_T_NONE;
 	status = sbull_xfer_bio(dev, bio);
-	bio->bi_status = status;
+	bio->bi_status = errno_to_blk_status(status);
 	bio_endio(bio);
 	return BLK_QC_T_NONE;
 }
@@ -272,11 +1595,19 @@ static blk_qc_t sbull_make_request(struct bio *bio)
 static int sbull_open(struct block_device *bdev, fmode_t mode)
 {
 	struct sbull_dev *dev = bdev->bd_disk->private_data;
+	int first;
 
 	del_timer_sync(&dev->timer);
 	//filp->private_data = dev;
 	spin_lock(&dev->lock);
-	if (! dev->users) 
+	if (dev->dying) { /* a snapshot on its way out */
+		spin_unlock(&dev->lock);
+		return -ENXIO;
+	}
+	first = !dev->users++;
+	spin_unlock(&dev->lock);
+	/* revalidation frees the pages, and sleeps: not under the lock */
+	if (first)
 	{
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0))
 		check_disk_change(bdev);
@@ -295,8 +1626,6 @@ static int sbull_open(struct block_device *bdev, fmode_t mode)
                 }
 #endif
 	}
-	dev->users++;
-	spin_unlock(&dev->lock);
 	return 0;
 }
 
@@ -334,7 +1663,7 @@ int sbull_revalidate(struct gendisk *gd)
 	
 	if (dev->media_change) {
 		dev->media_change = 0;
-		memset (dev->data, 0, dev->size);
+		sbull_free_pages(dev);
 	}
 	return 0;
 }
@@ -354,13 +1683,93 @@ void sbull_invalidate(struct timer_list * ldev)
 #endif
 
 	spin_lock(&dev->lock);
-	if (dev->users || !dev->data) 
+	if (dev->users) 
 		printk (KERN_WARNING "sbull: timer sanity check failed\n");
 	else
 		dev->media_change = 1;
 	spin_unlock(&dev->lock);
 }
 
+/*
+ * Snapshots. The disk's top layer is frozen, and the disk and the new
+ * snapshot each get an empty layer of their own on top of it: nothing
+ * is copied, whatever the size of the disk, and the two share all the
+ * pages until they write them. A lookup walks the layers, so a chain
+ * of snapshots of snapshots makes reads a little slower; the frozen
+ * layers go away with the last disk above them. The snapshots take
+ * the spare slots, after the ndevices disks.
+ */
+static void sbull_teardown(struct sbull_dev *dev);
+static void setup_device(struct sbull_dev *dev, int which,
+		struct sbull_layer *below, int readonly);
+
+static int sbull_snapshot(struct sbull_dev *dev, unsigned long flags)
+{
+	struct sbull_dev *snap = NULL;
+	struct sbull_layer *frozen, *top;
+	int i, ret;
+
+	if (flags & ~SBULL_SNAP_RO)
+		return -EINVAL;
+	if (dev->tfm || dev->zones)
+		return -EOPNOTSUPP;
+	mutex_lock(&sbull_snap_mutex);
+	ret = -EBUSY;
+	if (atomic_read(&dev->dax_maps))
+		goto out; /* stores there would go to the frozen layer */
+	ret = -ENOSPC;
+	for (i = ndevices; i < ndevices + max_snapshots; i++)
+		if (!Devices[i].top) {
+			snap = Devices + i;
+			break;
+		}
+	if (!snap)
+		goto out;
+	ret = -ENOMEM;
+	frozen = dev->top;
+	top = sbull_new_layer(frozen); /* takes over the disk's reference */
+	if (!top)
+		goto out;
+
+	blk_mq_freeze_queue(dev->queue);
+	dev->top = top;
+	blk_mq_unfreeze_queue(dev->queue);
+
+	setup_device(snap, i, frozen, flags & SBULL_SNAP_RO);
+	if (!snap->gd) {
+		sbull_teardown(snap);
+		goto out;
+	}
+	ret = i;
+  out:
+	mutex_unlock(&sbull_snap_mutex);
+	return ret;
+}
+
+static int sbull_drop(unsigned long which)
+{
+	struct sbull_dev *dev;
+	int ret = -EINVAL;
+
+	if (which < ndevices || which >= ndevices + max_snapshots)
+		return -EINVAL;
+	dev = Devices + which;
+	mutex_lock(&sbull_snap_mutex);
+	if (!dev->top)
+		goto out;
+	spin_lock(&dev->lock);
+	ret = dev->users || dev->dax_opens || atomic_read(&dev->dax_maps) ?
+			-EBUSY : 0;
+	if (!ret)
+		dev->dying = 1;
+	spin_unlock(&dev->lock);
+	if (!ret)
+		sbull_teardown(dev);
+  out:
+	mutex_unlock(&sbull_snap_mutex);
+	return ret;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -380,7 +1789,7 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 		 * and calculate the corresponding number of cylinders.  We set the
 		 * start of data at sector four.
 		 */
-		size = dev->size*(hardsect_size/KERNEL_SECTOR_SIZE);
+		size = dev->size/KERNEL_SECTOR_SIZE;
 		geo.cylinders = (size & ~0x3f) >> 6;
 		geo.heads = 4;
 		geo.sectors = 16;
@@ -388,6 +1797,16 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 		if (copy_to_user((void __user *) arg, &geo, sizeof(geo)))
 			return -EFAULT;
 		return 0;
+
+	    case SBULL_IOCSNAPSHOT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return sbull_snapshot(dev, arg);
+
+	    case SBULL_IOCDROP:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return sbull_drop(arg);
 	}
 
 	return -ENOTTY; /* unknown command */
@@ -395,6 +1814,240 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 
 
 
+/*
+ * Direct access. The kernel's DAX only works on device memory (pmem,
+ * ZONE_DEVICE), not on pages from the page allocator, which is why brd
+ * dropped it; so a filesystem can't map sbull's pages. A char device
+ * can, though: /dev/sbullXdax maps the disk's own pages, and a load or
+ * store there is one on the data of the disk, with no page cache and no
+ * copy in between. A page that is mapped gets allocated, as a write
+ * would. Discarding a mapped page detaches it from the disk: the
+ * mapping keeps the old page. Zoned disks can't be mapped, as stores
+ * would bypass the write pointers.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+typedef int vm_fault_t;
+#endif
+static vm_fault_t sbull_dax_fault(struct vm_fault *vmf)
+{
+	struct sbull_dev *dev = vmf->vma->vm_private_data;
+	struct page *page;
+
+	if (((u64)vmf->pgoff << PAGE_SHIFT) >= dev->size)
+		return VM_FAULT_SIGBUS;
+	/*
+	 * sbull_discard() may take the page away as soon as it is in the
+	 * index: only a page found under rcu_read_lock() is still there
+	 * to take a reference on. If it went, allocate another.
+	 */
+	for (;;) {
+		if (!sbull_insert_page(dev, vmf->pgoff))
+			return VM_FAULT_OOM;
+		rcu_read_lock();
+		page = xa_load(&dev->top->pages, vmf->pgoff);
+		if (page && !xa_is_value(page) && get_page_unless_zero(page))
+			break;
+		rcu_read_unlock();
+	}
+	rcu_read_unlock();
+	vmf->page = page;
+	return 0;
+}
+
+static void sbull_dax_vma_open(struct vm_area_struct *vma)
+{
+	struct sbull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->dax_maps);
+}
+
+static void sbull_dax_vma_close(struct vm_area_struct *vma)
+{
+	struct sbull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->dax_maps);
+}
+
+static const struct vm_operations_struct sbull_dax_vm_ops = {
+	.open = sbull_dax_vma_open,
+	.close = sbull_dax_vma_close,
+	.fault = sbull_dax_fault,
+};
+
+/*
+ * cdev_del() doesn't close the files already open, so a snapshot is
+ * only dropped when none is; one that is going can't be opened.
+ */
+static int sbull_dax_open(struct inode *inode, struct file *filp)
+{
+	struct sbull_dev *dev = container_of(inode->i_cdev, struct sbull_dev,
+			dax_cdev);
+	int ret = 0;
+
+	mutex_lock(&sbull_snap_mutex);
+	if (!dev->top || dev->dying)
+		ret = -ENXIO;
+	else
+		dev->dax_opens++;
+	mutex_unlock(&sbull_snap_mutex);
+	filp->private_data = dev;
+	return ret;
+}
+
+static int sbull_dax_release(struct inode *inode, struct file *filp)
+{
+	struct sbull_dev *dev = filp->private_data;
+
+	mutex_lock(&sbull_snap_mutex);
+	dev->dax_opens--;
+	mutex_unlock(&sbull_snap_mutex);
+	return 0;
+}
+
+static int sbull_dax_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct sbull_dev *dev = filp->private_data;
+
+	if (dev->zones || dev->tfm)
+		return -EINVAL;
+	if (dev->readonly) { /* and mprotect() can't make it writable */
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+		vma->vm_flags &= ~VM_MAYWRITE;
+#else
+		vm_flags_clear(vma, VM_MAYWRITE);
+#endif
+	}
+	vma->vm_ops = &sbull_dax_vm_ops;
+	vma->vm_private_data = dev;
+	mutex_lock(&sbull_snap_mutex); /* not while a snapshot is taken */
+	atomic_inc(&dev->dax_maps);
+	mutex_unlock(&sbull_snap_mutex);
+	return 0;
+}
+
+static const struct file_operations sbull_dax_fops = {
+	.owner  = THIS_MODULE,
+	.open   = sbull_dax_open,
+	.release = sbull_dax_release,
+	.mmap   = sbull_dax_mmap,
+	.llseek = noop_llseek,
+};
+
+static void sbull_setup_dax(struct sbull_dev *dev, int which)
+{
+	int err;
+
+	cdev_init(&dev->dax_cdev, &sbull_dax_fops);
+	dev->dax_cdev.owner = THIS_MODULE;
+	err = cdev_add(&dev->dax_cdev, MKDEV(sbull_dax_major, which), 1);
+	if (err) {
+		printk(KERN_NOTICE "sbull: error %d adding sbull%cdax\n",
+				err, which + 'a');
+		dev->dax_cdev.dev = 0;
+	}
+}
+
+/*
+ * The compression statistics, in the disk's sysfs directory, in
+ * compressed mode only.
+ */
+#define SBULL_SHOW(name, expr)						\
+static ssize_t name##_show(struct device *ddev,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct sbull_dev *dev = dev_to_disk(ddev)->private_data;	\
+									\
+	return sprintf(buf, "%llu\n", (unsigned long long) (expr));	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+SBULL_SHOW(compr_pages, READ_ONCE(dev->zpages));
+SBULL_SHOW(huge_pages, READ_ONCE(dev->huge_pages));
+SBULL_SHOW(same_pages, READ_ONCE(dev->same_pages));
+SBULL_SHOW(compr_data_size, READ_ONCE(dev->zbytes));
+SBULL_SHOW(orig_data_size, ((u64) READ_ONCE(dev->zpages) +
+			READ_ONCE(dev->same_pages)) << PAGE_SHIFT);
+
+static ssize_t comp_algorithm_show(struct device *ddev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", comp_alg);
+}
+static DEVICE_ATTR_RO(comp_algorithm);
+
+static struct attribute *sbull_zattrs[] = {
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_compr_pages.attr,
+	&dev_attr_huge_pages.attr,
+	&dev_attr_same_pages.attr,
+	NULL,
+};
+
+static umode_t sbull_zattr_visible(struct kobject *kobj,
+		struct attribute *attr, int n)
+{
+	struct sbull_dev *dev = dev_to_disk(kobj_to_dev(kobj))->private_data;
+
+	return dev->tfm ? attr->mode : 0;
+}
+
+static const struct attribute_group sbull_zattr_group = {
+	.attrs = sbull_zattrs,
+	.is_visible = sbull_zattr_visible,
+};
+
+/*
+ * And the write cache statistics, when there is one.
+ */
+static u64 sbull_cache_dirty(struct sbull_dev *dev)
+{
+	s64 ns = ktime_to_ns(ktime_sub(READ_ONCE(dev->wc_clean), ktime_get()));
+
+	if (ns <= 0)
+		return 0;
+	/* MB/s are bytes per microsecond */
+	return div_u64((u64) ns * div_u64(dev->wc_rate, 1000000), 1000);
+}
+
+SBULL_SHOW(cache_size, dev->wc_size);
+SBULL_SHOW(cache_dirty, sbull_cache_dirty(dev));
+SBULL_SHOW(flushes, READ_ONCE(dev->flushes));
+SBULL_SHOW(flush_latency_ns, dev->flushes ?
+		div64_u64(dev->flush_ns, dev->flushes) : 0);
+SBULL_SHOW(flush_latency_max_ns, READ_ONCE(dev->flush_max_ns));
+
+static struct attribute *sbull_cattrs[] = {
+	&dev_attr_cache_size.attr,
+	&dev_attr_cache_dirty.attr,
+	&dev_attr_flushes.attr,
+	&dev_attr_flush_latency_ns.attr,
+	&dev_attr_flush_latency_max_ns.attr,
+	NULL,
+};
+
+static umode_t sbull_cattr_visible(struct kobject *kobj,
+		struct attribute *attr, int n)
+{
+	struct sbull_dev *dev = dev_to_disk(kobj_to_dev(kobj))->private_data;
+
+	return dev->wc_size ? attr->mode : 0;
+}
+
+static const struct attribute_group sbull_cattr_group = {
+	.attrs = sbull_cattrs,
+	.is_visible = sbull_cattr_visible,
+};
+
+static const struct attribute_group *sbull_disk_groups[] = {
+	&sbull_zattr_group,
+	&sbull_cattr_group,
+	NULL,
+};
+
 /*
  * The device operations structure.
  */
@@ -408,35 +2061,209 @@ static struct block_device_operations sbull_ops = {
 	.submit_bio      = sbull_make_request,
 #endif
 	.revalidate_disk = sbull_revalidate,
+#ifdef SBULL_ZONED
+	.report_zones    = sbull_report_zones,
+#endif
 	.ioctl	         = sbull_ioctl
 };
 
+/*
+ * Polling: complete whatever the poll queue has done, and is due.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0))
+static int sbull_poll(struct blk_mq_hw_ctx *hctx)
+#else
+static int sbull_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+#endif
+{
+	struct sbull_queue *sq = hctx->driver_data;
+	struct request *req, *next;
+	struct sbull_cmd *cmd;
+	ktime_t now = ktime_get();
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&sq->lock);
+	list_splice_init(&sq->list, &list);
+	spin_unlock(&sq->lock);
+	list_for_each_entry_safe(req, next, &list, queuelist) {
+		cmd = blk_mq_rq_to_pdu(req);
+		if (ktime_after(cmd->deadline, now))
+			continue;
+		list_del_init(&req->queuelist);
+		sbull_finish(req, cmd->status);
+		nr++;
+	}
+	if (!list_empty(&list)) { /* not yet: back to the front */
+		spin_lock(&sq->lock);
+		list_splice(&list, &sq->list);
+		spin_unlock(&sq->lock);
+	}
+	return nr;
+}
+
+static int sbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+		unsigned int index)
+{
+	struct sbull_dev *dev = data;
+
+	hctx->driver_data = dev->queues + index;
+	return 0;
+}
+
+/*
+ * The default queues come first, then the poll queues; there are no
+ * separate read queues.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0))
+static int sbull_map_queues(struct blk_mq_tag_set *set)
+#else
+static void sbull_map_queues(struct blk_mq_tag_set *set)
+#endif
+{
+	int i, offset = 0;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i) {
+		    case HCTX_TYPE_DEFAULT:
+			map->nr_queues = nr_hw_queues;
+			break;
+		    case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
+		    default:
+			map->nr_queues = 0;
+			continue;
+		}
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0))
+	return 0;
+#endif
+}
+
 static struct blk_mq_ops mq_ops_simple = {
     .queue_rq = sbull_request,
+    .complete = sbull_complete,
+    .init_request = sbull_init_request,
+    .init_hctx = sbull_init_hctx,
+    .map_queues = sbull_map_queues,
+    .poll = sbull_poll,
 };
 
 static struct blk_mq_ops mq_ops_full = {
     .queue_rq = sbull_full_request,
+    .complete = sbull_complete,
+    .init_request = sbull_init_request,
+    .init_hctx = sbull_init_hctx,
+    .map_queues = sbull_map_queues,
+    .poll = sbull_poll,
 };
 
+/*
+ * Allocate the tag set and a queue on it, with nr_hw_queues hardware
+ * contexts of queue_depth tags each, plus poll_queues for polling.
+ */
+static struct request_queue *sbull_init_mq_queue(struct sbull_dev *dev,
+		const struct blk_mq_ops *ops)
+{
+	struct request_queue *q;
+	int i, nr = nr_hw_queues + poll_queues;
+
+	dev->queues = kcalloc(nr, sizeof(*dev->queues), GFP_KERNEL);
+	if (!dev->queues)
+		return NULL;
+	for (i = 0; i < nr; i++) {
+		spin_lock_init(&dev->queues[i].lock);
+		INIT_LIST_HEAD(&dev->queues[i].list);
+	}
+	dev->tag_set.ops = ops;
+	dev->tag_set.nr_hw_queues = nr;
+	dev->tag_set.nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+	dev->tag_set.cmd_size = sizeof(struct sbull_cmd);
+	dev->tag_set.queue_depth = queue_depth;
+	dev->tag_set.numa_node = NUMA_NO_NODE;
+	/* writes allocate their pages, and may sleep */
+	dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	dev->tag_set.driver_data = dev;
+	if (blk_mq_alloc_tag_set(&dev->tag_set))
+		goto out_free;
+	q = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(q)) {
+		blk_mq_free_tag_set(&dev->tag_set);
+		goto out_free;
+	}
+	return q;
+
+  out_free:
+	kfree(dev->queues);
+	dev->queues = NULL;
+	return NULL;
+}
+
+
+/*
+ * The value of a per-device parameter for device "which".
+ */
+static unsigned long sbull_param(unsigned long *values, int n, int which)
+{
+	if (n == 0)
+		return 0;
+	return which < n ? values[which] : values[0];
+}
+
+static void sbull_setup_emulation(struct sbull_dev *dev, int which)
+{
+	dev->latency = sbull_param(latency_ns, nr_latency_ns, which);
+	dev->jitter = min(sbull_param(latency_jitter_ns, nr_latency_jitter_ns,
+				which), (unsigned long) NSEC_PER_SEC);
+	dev->tail = sbull_param(latency_tail_ns, nr_latency_tail_ns, which);
+	dev->tail_pct = min(sbull_param(latency_tail_pct, nr_latency_tail_pct,
+				which), 100UL);
+	dev->bandwidth = (u64) sbull_param(bandwidth_mb, nr_bandwidth_mb,
+			which) * 1000000;
+	dev->iops = sbull_param(iops, nr_iops, which);
+	dev->wc_rate = (u64) sbull_param(destage_mb, nr_destage_mb,
+			which) * 1000000;
+	if (dev->wc_rate) {
+		dev->wc_size = (u64) sbull_param(write_cache_kb,
+				nr_write_cache_kb, which) * 1024;
+		dev->wc_window = div64_u64(dev->wc_size * NSEC_PER_SEC,
+				dev->wc_rate);
+	}
+	dev->emulate = dev->latency || dev->jitter || dev->tail_pct ||
+			dev->bandwidth || dev->iops || dev->wc_size;
+	spin_lock_init(&dev->rate_lock);
+	if (dev->emulate && request_mode == RM_NOQUEUE) {
+		printk(KERN_NOTICE "sbull: no media emulation without a request queue\n");
+		dev->wc_size = 0;
+	}
+}
 
 /*
- * Set up our internal device.
+ * Set up our internal device, a snapshot if "below" is the frozen
+ * layer of another disk.
  */
-static void setup_device(struct sbull_dev *dev, int which)
+static void setup_device(struct sbull_dev *dev, int which,
+		struct sbull_layer *below, int readonly)
 {
 	/*
 	 * Get some memory.
 	 */
 	memset (dev, 0, sizeof (struct sbull_dev));
-	dev->size = nsectors*hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if (dev->data == NULL) {
-		printk (KERN_NOTICE "vmalloc failure.\n");
+	dev->size = (u64)nsectors*hardsect_size;
+	dev->top = sbull_new_layer(below);	/* no memory until it is written */
+	if (!dev->top)
 		return;
-	}
+	if (below)
+		kref_get(&below->kref);
+	dev->readonly = readonly;
 	spin_lock_init(&dev->lock);
-	
+
 	/*
 	 * The timer which "invalidates" the device.
 	 */
@@ -448,6 +2275,11 @@ static void setup_device(struct sbull_dev *dev, int which)
         timer_setup(&dev->timer, sbull_invalidate, 0);
 #endif
 
+	sbull_setup_emulation(dev, which);
+	if (compress && !below)
+		sbull_setup_compression(dev);
+	if (zoned && !below && sbull_setup_zones(dev))
+		return;
 
 	
 	/*
@@ -462,14 +2294,14 @@ static void setup_device(struct sbull_dev *dev, int which)
 		dev->queue =  blk_generic_alloc_queue(NUMA_NO_NODE);
 #endif
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 
 	    case RM_FULL:
 		//dev->queue = blk_init_queue(sbull_full_request, &dev->lock);
-		dev->queue = blk_mq_init_sq_queue(&dev->tag_set, &mq_ops_full, 128, BLK_MQ_F_SHOULD_MERGE);
+		dev->queue = sbull_init_mq_queue(dev, &mq_ops_full);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 
 	    default:
@@ -478,12 +2310,26 @@ static void setup_device(struct sbull_dev *dev, int which)
 	
 	    case RM_SIMPLE:
 		//dev->queue = blk_init_queue(sbull_request, &dev->lock);
-		dev->queue = blk_mq_init_sq_queue(&dev->tag_set, &mq_ops_simple, 128, BLK_MQ_F_SHOULD_MERGE);
+		dev->queue = sbull_init_mq_queue(dev, &mq_ops_simple);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 	}
 	blk_queue_logical_block_size(dev->queue, hardsect_size);
+	/* the block layer sends flushes, and FUA, only if there is a cache */
+	blk_queue_write_cache(dev->queue, dev->wc_size != 0, dev->wc_size != 0);
+	/*
+	 * Discarding gives memory back, a page at a time. Take ranges as
+	 * large as the block layer can make them. Zones are reset instead.
+	 */
+	if (!dev->zones) {
+		dev->queue->limits.discard_granularity = PAGE_SIZE;
+		blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+		blk_queue_max_write_zeroes_sectors(dev->queue, UINT_MAX);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0))
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+#endif
+	}
 	dev->queue->queuedata = dev;
 	/*
 	 * And the gendisk structure.
@@ -491,7 +2337,7 @@ static void setup_device(struct sbull_dev *dev, int which)
 	dev->gd = alloc_disk(SBULL_MINORS);
 	if (! dev->gd) {
 		printk (KERN_NOTICE "alloc_disk failure\n");
-		goto out_vfree;
+		return;
 	}
 	dev->gd->major = sbull_major;
 	dev->gd->first_minor = which*SBULL_MINORS;
@@ -499,13 +2345,17 @@ static void setup_device(struct sbull_dev *dev, int which)
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
 	snprintf (dev->gd->disk_name, 32, "sbull%c", which + 'a');
-	set_capacity(dev->gd, nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
-	add_disk(dev->gd);
-	return;
-
-  out_vfree:
-	if (dev->data)
-		vfree(dev->data);
+	set_capacity(dev->gd, dev->size/KERNEL_SECTOR_SIZE);
+	set_disk_ro(dev->gd, readonly);
+	if (dev->zones && sbull_register_zones(dev)) {
+		printk (KERN_NOTICE "sbull: can't set up the zones\n");
+		put_disk(dev->gd);
+		dev->gd = NULL;
+		return;
+	}
+	device_add_disk(NULL, dev->gd, sbull_disk_groups);
+	if (sbull_dax_major && !dev->zones && !dev->tfm)
+		sbull_setup_dax(dev, which);
 }
 
 
@@ -513,6 +2363,14 @@ static void setup_device(struct sbull_dev *dev, int which)
 static int __init sbull_init(void)
 {
 	int i;
+	if (zoned && (request_mode == RM_NOQUEUE || !is_power_of_2(zone_size) ||
+			zone_size * 1024 < PAGE_SIZE ||
+			zone_size * 1024 < hardsect_size)) {
+		printk(KERN_WARNING "sbull: zoned mode needs a request queue, and "
+				"zones of a power of two KiB, at least a page\n");
+		return -EINVAL;
+	}
+	max_snapshots = clamp(max_snapshots, 0, 16 - min(ndevices, 16));
 	/*
 	 * Get registered.
 	 */
@@ -521,44 +2379,94 @@ static int __init sbull_init(void)
 		printk(KERN_WARNING "sbull: unable to get major number\n");
 		return -EBUSY;
 	}
+	if (dax) {
+		dev_t devt;
+
+		if (alloc_chrdev_region(&devt, 0, ndevices + max_snapshots,
+				"sbulldax") == 0)
+			sbull_dax_major = MAJOR(devt);
+		else
+			printk(KERN_NOTICE "sbull: no direct access devices\n");
+	}
+	if (nr_hw_queues <= 0)
+		nr_hw_queues = num_online_cpus();
+	nr_hw_queues = min_t(int, nr_hw_queues, nr_cpu_ids);
+	queue_depth = clamp(queue_depth, 1, BLK_MQ_MAX_DEPTH);
+	poll_queues = clamp(poll_queues, 0, (int) nr_cpu_ids);
+	if (request_mode == RM_NOQUEUE) {
+		/* unbound: the chunks of a bio should spread over the CPUs */
+		sbull_wq = alloc_workqueue("sbull", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+		if (!sbull_wq)
+			printk(KERN_NOTICE "sbull: no parallel copies\n");
+	}
 	/*
-	 * Allocate the device array, and initialize each one.
+	 * Allocate the device array, with room for the snapshots, and
+	 * initialize each disk.
 	 */
-	Devices = kmalloc(ndevices*sizeof (struct sbull_dev), GFP_KERNEL);
+	Devices = kcalloc(ndevices + max_snapshots, sizeof (struct sbull_dev),
+			GFP_KERNEL);
 	if (Devices == NULL)
 		goto out_unregister;
 	for (i = 0; i < ndevices; i++) 
-		setup_device(Devices + i, i);
+		setup_device(Devices + i, i, NULL, 0);
     
 	return 0;
 
   out_unregister:
+	if (sbull_wq)
+		destroy_workqueue(sbull_wq);
+	if (sbull_dax_major)
+		unregister_chrdev_region(MKDEV(sbull_dax_major, 0),
+				ndevices + max_snapshots);
 	unregister_blkdev(sbull_major, "sbd");
 	return -ENOMEM;
 }
 
+/*
+ * Take a disk apart; its slot can be set up again afterwards.
+ */
+static void sbull_teardown(struct sbull_dev *dev)
+{
+	if (!dev->top)
+		return; /* never set up */
+	del_timer_sync(&dev->timer);
+	if (dev->dax_cdev.dev)
+		cdev_del(&dev->dax_cdev);
+	if (dev->gd) {
+		del_gendisk(dev->gd);
+		put_disk(dev->gd);
+	}
+	if (sbull_wq)
+		flush_workqueue(sbull_wq); /* bios copied in parallel */
+	if (dev->queue) {
+		if (request_mode == RM_NOQUEUE)
+			//kobject_put (&dev->queue->kobj);
+			blk_put_queue(dev->queue);
+		else {
+			blk_cleanup_queue(dev->queue);
+			blk_mq_free_tag_set(&dev->tag_set);
+			kfree(dev->queues);
+		}
+	}
+	sbull_free_pages(dev);
+	kref_put(&dev->top->kref, sbull_release_layer); /* empty by now */
+	sbull_cleanup_compression(dev);
+	kvfree(dev->zones);
+	memset(dev, 0, sizeof(*dev));
+}
+
 static void sbull_exit(void)
 {
 	int i;
 
-	for (i = 0; i < ndevices; i++) {
-		struct sbull_dev *dev = Devices + i;
-
-		del_timer_sync(&dev->timer);
-		if (dev->gd) {
-			del_gendisk(dev->gd);
-			put_disk(dev->gd);
-		}
-		if (dev->queue) {
-			if (request_mode == RM_NOQUEUE)
-				//kobject_put (&dev->queue->kobj);
-				blk_put_queue(dev->queue);
-			else
-				blk_cleanup_queue(dev->queue);
-		}
-		if (dev->data)
-			vfree(dev->data);
-	}
+	for (i = 0; i < ndevices + max_snapshots; i++)
+		sbull_teardown(Devices + i);
+	rcu_barrier(); /* pages being freed by sbull_discard() */
+	if (sbull_wq)
+		destroy_workqueue(sbull_wq);
+	if (sbull_dax_major)
+		unregister_chrdev_region(MKDEV(sbull_dax_major, 0),
+				ndevices + max_snapshots);
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
 }
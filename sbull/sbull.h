@@ -52,6 +52,17 @@
 #define SBULL_HARDSECT 512  /* 2.2 and 2.4 can used different values */
 
 #define SBULLR_MAJOR 0      /* Dynamic major for raw device */
+
+/*
+ * Ioctl definitions. A snapshot is a new disk, sharing the data of
+ * the disk it is taken from; SBULL_IOCSNAPSHOT returns its index, and
+ * SBULL_IOCDROP removes the snapshot with that index.
+ */
+#define SBULL_IOC_MAGIC  'k'
+#define SBULL_IOCSNAPSHOT _IO(SBULL_IOC_MAGIC, 32)
+#define SBULL_IOCDROP     _IO(SBULL_IOC_MAGIC, 33)
+
+#define SBULL_SNAP_RO     1 /* a read-only snapshot */
 /*
  * The sbull device is removable: if it is left closed for more than
  * half a minute, it is removed. Thus use a usage count and a
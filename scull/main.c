@@ -27,12 +27,14 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/jiffies.h>
 
 #include <linux/uaccess.h>	/* copy_*_user */
 
 #include "scull.h"		/* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
+#include "shrinker_version.h"
 
 /*
  * Our parameters which can be set at load time.
@@ -43,12 +45,16 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_shrink =  SCULL_SHRINK_NONE;	/* initial policy of all devices */
+int scull_shrink_idle = 30;	/* seconds before a device counts as idle */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_shrink, int, S_IRUGO);
+module_param(scull_shrink_idle, int, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -77,11 +83,93 @@ int scull_trim(struct scull_dev *dev)
 		kfree(dptr);
 	}
 	dev->size = 0;
+	dev->nquanta = 0;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
 	dev->data = NULL;
 	return 0;
 }
+
+/*
+ * Memory pressure: idle devices give quanta back according to their
+ * own policy. Reclaim may run from our own allocations, with a device
+ * lock held, so we only ever try the locks and skip busy devices.
+ */
+static struct shrinker *scull_shrinker;
+
+static int scull_idle(struct scull_dev *dev)
+{
+	return time_after(jiffies, dev->atime + scull_shrink_idle * HZ);
+}
+
+static unsigned long scull_shrink_count(struct shrinker *s,
+		struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	int i;
+
+	/* no locking: an estimate is all the VM asks for */
+	for (i = 0; i < scull_nr_devs; i++) {
+		struct scull_dev *dev = scull_devices + i;
+
+		if (READ_ONCE(dev->shrink) != SCULL_SHRINK_NONE &&
+				scull_idle(dev))
+			count += READ_ONCE(dev->nquanta);
+	}
+	return count;
+}
+
+/* Free up to "nr" quanta that hold nothing but zeros */
+static unsigned long scull_shrink_zero(struct scull_dev *dev,
+		unsigned long nr)
+{
+	struct scull_qset *dptr;
+	unsigned long freed = 0;
+	int i;
+
+	for (dptr = dev->data; dptr && freed < nr; dptr = dptr->next) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < dev->qset && freed < nr; i++) {
+			if (!dptr->data[i] ||
+					memchr_inv(dptr->data[i], 0, dev->quantum))
+				continue;
+			kfree(dptr->data[i]);
+			dptr->data[i] = NULL;
+			freed++;
+		}
+	}
+	dev->nquanta -= freed;
+	return freed;
+}
+
+static unsigned long scull_shrink_scan(struct shrinker *s,
+		struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < scull_nr_devs && freed < sc->nr_to_scan; i++) {
+		struct scull_dev *dev = scull_devices + i;
+
+		if (!mutex_trylock(&dev->lock))
+			continue;
+		if (scull_idle(dev)) {
+			switch (dev->shrink) {
+			case SCULL_SHRINK_ZERO:
+				freed += scull_shrink_zero(dev,
+						sc->nr_to_scan - freed);
+				break;
+			case SCULL_SHRINK_DISCARD:
+				freed += dev->nquanta;
+				scull_trim(dev);
+				break;
+			}
+		}
+		mutex_unlock(&dev->lock);
+	}
+	return freed ? freed : SHRINK_STOP;
+}
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * The proc filesystem: function to read and entry
@@ -99,6 +187,8 @@ int scull_read_procmem(struct seq_file *s, void *v)
                         return -ERESTARTSYS;
                 seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
                              i, d->qset, d->quantum, d->size);
+                seq_printf(s,"  shrink policy %i, %lu quanta\n",
+                             d->shrink, d->nquanta);
                 for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
                         seq_printf(s, "  item at %p, qset at %p\n",
                                      qs, qs->data);
@@ -317,18 +407,25 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scull_follow(dev, item);
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+	if (dptr == NULL)
+		goto out;
 
 	/* read only up to the end of this quantum */
 	if (count > quantum - q_pos)
 		count = quantum - q_pos;
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+	if (!dptr->data || !dptr->data[s_pos]) {
+		/* a hole below "size" (maybe reclaimed zeros) reads as zeros */
+		if (clear_user(buf, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
+	} else if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
 		retval = -EFAULT;
 		goto out;
 	}
 	*f_pos += count;
+	dev->atime = jiffies;
 	retval = count;
 
   out:
@@ -365,9 +462,10 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
+		dptr->data[s_pos] = kzalloc(quantum, GFP_KERNEL);
 		if (!dptr->data[s_pos])
 			goto out;
+		dev->nquanta++;
 	}
 	/* write only up to the end of this quantum */
 	if (count > quantum - q_pos)
@@ -378,6 +476,7 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 		goto out;
 	}
 	*f_pos += count;
+	dev->atime = jiffies;
 	retval = count;
 
         /* update the size */
@@ -396,6 +495,7 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	struct scull_dev *dev = filp->private_data;
 	int err = 0, tmp;
 	int retval = 0;
     
@@ -508,6 +608,25 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	/*
+	 * The shrink policy belongs to a bare scull device; the pipe and
+	 * the access devices share this method, but have no such thing.
+	 */
+	  case SCULL_IOCTSHRINK: /* Tell, but for this device only */
+		if (filp->f_op != &scull_fops)
+			return -ENOTTY;
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (arg > SCULL_SHRINK_DISCARD)
+			return -EINVAL;
+		dev->shrink = arg;
+		break;
+
+	  case SCULL_IOCQSHRINK:
+		if (filp->f_op != &scull_fops)
+			return -ENOTTY;
+		return dev->shrink;
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -574,6 +693,9 @@ void scull_cleanup_module(void)
 	int i;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	shrinker_destroy_wrapper(scull_shrinker);
+	scull_shrinker = NULL;
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
@@ -650,6 +772,8 @@ int scull_init_module(void)
 	for (i = 0; i < scull_nr_devs; i++) {
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
+		scull_devices[i].shrink = scull_shrink;
+		scull_devices[i].atime = jiffies;
 		mutex_init(&scull_devices[i].lock);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
@@ -659,6 +783,11 @@ int scull_init_module(void)
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);
 
+	scull_shrinker = shrinker_create_wrapper("scull",
+			scull_shrink_count, scull_shrink_scan);
+	if (!scull_shrinker)
+		printk(KERN_NOTICE "scull: can't register shrinker\n");
+
 #ifdef SCULL_DEBUG /* only when debugging */
 	scull_create_proc();
 #endif
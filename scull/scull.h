@@ -90,10 +90,20 @@ struct scull_dev {
 	int qset;                 /* the current array size */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
+	int shrink;               /* reclaim policy, see below */
+	unsigned long atime;      /* jiffies at the last read or write */
+	unsigned long nquanta;    /* quanta allocated to the device */
 	struct mutex lock;     /* mutual exclusion semaphore     */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
+/*
+ * What the shrinker may do with an idle device under memory pressure.
+ */
+#define SCULL_SHRINK_NONE     0 /* refuse: keep every quantum */
+#define SCULL_SHRINK_ZERO     1 /* free quanta holding only zeros */
+#define SCULL_SHRINK_DISCARD  2 /* drop all the data, like a cache */
+
 /*
  * Split minors in two parts
  */
@@ -108,9 +118,13 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_shrink;
+extern int scull_shrink_idle;
 
 extern int scull_p_buffer;	/* pipe.c */
 
+extern struct file_operations scull_fops;
+
 
 /*
  * Prototypes for shared functions
@@ -169,8 +183,12 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/* Reclaim policy of the device the ioctl is issued on */
+#define SCULL_IOCTSHRINK _IO(SCULL_IOC_MAGIC,   15)
+#define SCULL_IOCQSHRINK _IO(SCULL_IOC_MAGIC,   16)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 16
 
 #endif /* _SCULL_H_ */
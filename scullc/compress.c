@@ -0,0 +1,201 @@
+/*  -*- C -*-
+ * compress.c -- compression of cold quanta for the scullc char module
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/errno.h>	/* error codes */
+#include <linux/crypto.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/workqueue.h>
+
+#include "scullc.h"		/* local definitions */
+
+int scullc_compress = 0;		/* initial setting of all devices */
+int scullc_comp_interval = 60;	/* seconds between two cold scans */
+static char *scullc_comp_alg = "lz4";
+
+module_param(scullc_compress, int, 0);
+module_param(scullc_comp_interval, int, 0644);
+module_param(scullc_comp_alg, charp, 0);
+
+/*
+ * One transform and one output buffer, shared by all devices.  The
+ * transform keeps working memory in its context, so it is serialized
+ * by scullc_comp_mutex.  Lock ordering is device lock first, then this
+ * mutex, and nothing allocates with reclaim while holding it: the
+ * shrinker can compress too.
+ */
+static struct crypto_comp *scullc_tfm;
+static DEFINE_MUTEX(scullc_comp_mutex);
+static u8 *scullc_zbuf;
+
+static void scullc_comp_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scullc_comp_work, scullc_comp_worker);
+
+int scullc_compress_available(void)
+{
+	return scullc_tfm != NULL;
+}
+
+/*
+ * Replace the quantum in "slot" with a compressed copy.  Returns
+ * -E2BIG when compression does not save at least a quarter, and
+ * -EBUSY if "reclaim" is set and the transform is in use.
+ */
+int scullc_compress_quantum(struct scullc_dev *dev, void **slot, int reclaim)
+{
+	struct scullc_zquantum *zq;
+	unsigned int len = SCULLC_QUANTUM_MAX;
+	int err;
+
+	if (reclaim) {
+		if (!mutex_trylock(&scullc_comp_mutex))
+			return -EBUSY;
+	} else
+		mutex_lock(&scullc_comp_mutex);
+
+	err = crypto_comp_compress(scullc_tfm, *slot, dev->quantum,
+			scullc_zbuf, &len);
+	if (err || len > dev->quantum - dev->quantum / 4) {
+		mutex_unlock(&scullc_comp_mutex);
+		return -E2BIG;
+	}
+	zq = kmalloc(sizeof(*zq) + len, GFP_NOWAIT | __GFP_NOWARN);
+	if (!zq) {
+		mutex_unlock(&scullc_comp_mutex);
+		return -ENOMEM;
+	}
+	zq->len = len;
+	memcpy(zq->data, scullc_zbuf, len);
+	mutex_unlock(&scullc_comp_mutex);
+
+	kmem_cache_free(dev->cache, *slot);
+	*slot = (void *)((unsigned long)zq | SCULLC_ZTAG);
+	dev->nquanta--;
+	dev->zquanta++;
+	dev->zbytes += len;
+	return 0;
+}
+
+/*
+ * Turn the compressed quantum in "slot" back into a plain one.
+ */
+int scullc_expand_quantum(struct scullc_dev *dev, void **slot)
+{
+	struct scullc_zquantum *zq = scullc_zq(*slot);
+	unsigned int len = dev->quantum;
+	void *q;
+	int err;
+
+	q = kmem_cache_alloc(dev->cache, GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
+	mutex_lock(&scullc_comp_mutex);
+	err = crypto_comp_decompress(scullc_tfm, zq->data, zq->len, q, &len);
+	mutex_unlock(&scullc_comp_mutex);
+	if (err || len != dev->quantum) {
+		printk(KERN_WARNING "scullc: can't expand quantum (%i)\n", err);
+		kmem_cache_free(dev->cache, q);
+		return -EIO;
+	}
+	dev->zquanta--;
+	dev->zbytes -= zq->len;
+	dev->nquanta++;
+	kfree(zq);
+	*slot = q;
+	return 0;
+}
+
+/*
+ * Compress up to "nr" quanta of the device, which must be locked.
+ * The background scan only takes quanta that were not used since its
+ * previous pass; reclaim takes any of them.
+ */
+unsigned long scullc_compress_cold(struct scullc_dev *dev, unsigned long nr,
+		int reclaim)
+{
+	struct scullc_dev *dptr;
+	unsigned long done = 0;
+	int i, err;
+
+	if (!scullc_tfm)
+		return 0;
+	for (dptr = dev; dptr && done < nr; dptr = dptr->next) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < dev->qset && done < nr; i++) {
+			if (!dptr->data[i] || !scullc_is_plain(dptr->data[i]))
+				continue;
+			if (!reclaim && test_and_clear_bit(i, dptr->hot))
+				continue;
+			err = scullc_compress_quantum(dev, dptr->data + i, reclaim);
+			if (err == -EBUSY)
+				return done;
+			if (err == 0)
+				done++;
+		}
+	}
+	return done;
+}
+
+static void scullc_comp_worker(struct work_struct *work)
+{
+	int i;
+
+	for (i = 0; i < scullc_devs; i++) {
+		struct scullc_dev *dev = scullc_devices + i;
+
+		if (!READ_ONCE(dev->compress))
+			continue;
+		mutex_lock(&dev->lock);
+		scullc_compress_cold(dev, ULONG_MAX, 0);
+		mutex_unlock(&dev->lock);
+	}
+	schedule_delayed_work(&scullc_comp_work,
+			max(scullc_comp_interval, 1) * HZ);
+}
+
+/*
+ * Compression is optional: if the algorithm is missing, the devices
+ * simply keep all their quanta as they are.
+ */
+void scullc_compress_init(void)
+{
+	struct crypto_comp *tfm;
+
+	tfm = crypto_alloc_comp(scullc_comp_alg, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_NOTICE "scullc: no \"%s\" compression (%li)\n",
+				scullc_comp_alg, PTR_ERR(tfm));
+		return;
+	}
+	scullc_zbuf = kmalloc(SCULLC_QUANTUM_MAX, GFP_KERNEL);
+	if (!scullc_zbuf) {
+		crypto_free_comp(tfm);
+		return;
+	}
+	scullc_tfm = tfm;
+	schedule_delayed_work(&scullc_comp_work,
+			max(scullc_comp_interval, 1) * HZ);
+}
+
+void scullc_compress_cleanup(void)
+{
+	if (!scullc_tfm)
+		return;
+	cancel_delayed_work_sync(&scullc_comp_work);
+	crypto_free_comp(scullc_tfm);
+	scullc_tfm = NULL;
+	kfree(scullc_zbuf);
+}
@@ -0,0 +1,218 @@
+/*  -*- C -*-
+ * dedup.c -- sharing of identical quanta for the scullc char module
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/errno.h>	/* error codes */
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/xxhash.h>
+#include <linux/seq_file.h>
+
+#include "scullc.h"		/* local definitions */
+
+int scullc_dedup = 0;		/* initial setting of all devices */
+module_param(scullc_dedup, int, 0);
+
+/*
+ * Every full quantum written to a device in dedup mode is looked up
+ * here by content; all the devices share the table.  The lock is a
+ * spinlock because trim, and so the shrinker, drops references: we
+ * never allocate or sleep while holding it.
+ */
+static DEFINE_HASHTABLE(scullc_dedup_table, 10);
+static DEFINE_SPINLOCK(scullc_dedup_lock);
+static unsigned long scullc_dedup_objs;	/* shared quanta in the table */
+static long scullc_dedup_saved;	/* bytes not allocated, net of entries */
+
+/*
+ * A quantum only enters the table once a twin of it is found: until
+ * then it stays private, so that compression and reclaim still apply,
+ * and costs no entry.  To find the twin, we remember where the last
+ * quantum with each hash (modulo the size of this array) was written.
+ * That is only a hint, checked against the data before use: the
+ * quantum may have been changed or freed since.
+ */
+#define SCULLC_DEDUP_HINTS 1024
+static struct scullc_dedup_hint {
+	u64 hash;
+	struct scullc_dev *dev;
+	long index;			/* of the quantum in the device */
+} scullc_dedup_hints[SCULLC_DEDUP_HINTS];
+
+/* The slot of quantum "index" in "dev", if the device goes that far */
+static void **scullc_dedup_slot(struct scullc_dev *dev, long index)
+{
+	struct scullc_dev *dptr = dev;
+	long item = index / dev->qset;
+
+	while (dptr && item--)
+		dptr = dptr->next;
+	if (!dptr || !dptr->data)
+		return NULL;
+	return dptr->data + index % dev->qset;
+}
+
+/* Share the plain quantum in "slot" with a twin in quantum "seen". */
+static void scullc_dedup_pair(struct scullc_dev *dev, void **slot,
+		struct scullc_dedup_hint *seen, u64 hash)
+{
+	struct scullc_dev *twin = seen->dev;
+	struct scullc_shared *sq;
+	void **tslot;
+
+	/* we hold dev->lock already: only try the other one */
+	if (twin != dev && !mutex_trylock(&twin->lock))
+		return;
+	tslot = scullc_dedup_slot(twin, seen->index);
+	if (!twin->dedup || twin->quantum != dev->quantum || !tslot ||
+			!*tslot || !scullc_is_plain(*tslot) ||
+			memcmp(*tslot, *slot, dev->quantum))
+		goto out;
+	sq = kmalloc(sizeof(*sq), GFP_KERNEL);
+	if (!sq)
+		goto out;
+	sq->hash = hash;
+	sq->quantum = dev->quantum;
+	sq->cache = dev->cache;
+	sq->refs = 2;
+	sq->data = *tslot;	/* the twin's quantum is the shared copy */
+
+	spin_lock(&scullc_dedup_lock);
+	hash_add(scullc_dedup_table, &sq->node, hash);
+	scullc_dedup_objs++;
+	scullc_dedup_saved += (long)kmem_cache_size(sq->cache) -
+			(long)sizeof(*sq);
+	spin_unlock(&scullc_dedup_lock);
+
+	*tslot = (void *)((unsigned long)sq | SCULLC_DTAG);
+	twin->nquanta--;
+	twin->dquanta++;
+	kmem_cache_free(dev->cache, *slot);
+	*slot = (void *)((unsigned long)sq | SCULLC_DTAG);
+	dev->nquanta--;
+	dev->dquanta++;
+  out:
+	if (twin != dev)
+		mutex_unlock(&twin->lock);
+}
+
+/*
+ * Fingerprint the plain quantum "index" of "dev", in "slot", and share
+ * it: either with an identical quantum already in the table, or with
+ * the last one written with the same hash, if it is still identical.
+ * Called with dev->lock held.
+ */
+int scullc_dedup_quantum(struct scullc_dev *dev, long index, void **slot)
+{
+	struct scullc_dedup_hint *hint, seen;
+	struct scullc_shared *sq;
+	void *q = *slot;
+	u64 hash = xxh64(q, dev->quantum, 0);
+
+	spin_lock(&scullc_dedup_lock);
+	hash_for_each_possible(scullc_dedup_table, sq, node, hash) {
+		if (sq->hash != hash || sq->quantum != dev->quantum ||
+				memcmp(sq->data, q, dev->quantum))
+			continue;
+		sq->refs++;
+		scullc_dedup_saved += kmem_cache_size(sq->cache);
+		spin_unlock(&scullc_dedup_lock);
+
+		kmem_cache_free(dev->cache, q);
+		*slot = (void *)((unsigned long)sq | SCULLC_DTAG);
+		dev->nquanta--;
+		dev->dquanta++;
+		return 0;
+	}
+	/* no shared copy yet: remember this one, and try the last one */
+	hint = scullc_dedup_hints + (hash & (SCULLC_DEDUP_HINTS - 1));
+	seen = *hint;
+	hint->hash = hash;
+	hint->dev = dev;
+	hint->index = index;
+	spin_unlock(&scullc_dedup_lock);
+
+	if (seen.dev && seen.hash == hash &&
+			(seen.dev != dev || seen.index != index))
+		scullc_dedup_pair(dev, slot, &seen, hash);
+	return 0;
+}
+
+/*
+ * Drop a reference to a shared quantum.
+ */
+void scullc_dedup_put(struct scullc_shared *sq)
+{
+	spin_lock(&scullc_dedup_lock);
+	if (--sq->refs) {
+		scullc_dedup_saved -= kmem_cache_size(sq->cache);
+		spin_unlock(&scullc_dedup_lock);
+		return;
+	}
+	hash_del(&sq->node);
+	scullc_dedup_objs--;
+	scullc_dedup_saved += sizeof(*sq);
+	spin_unlock(&scullc_dedup_lock);
+
+	kmem_cache_free(sq->cache, sq->data);
+	kfree(sq);
+}
+
+/*
+ * Copy on write: give "slot" a private quantum again.  The last user
+ * of a shared quantum just takes it back, without copying.
+ */
+int scullc_unshare_quantum(struct scullc_dev *dev, void **slot)
+{
+	struct scullc_shared *sq = scullc_sq(*slot);
+	void *q;
+
+	spin_lock(&scullc_dedup_lock);
+	if (sq->refs == 1) {
+		hash_del(&sq->node);
+		scullc_dedup_objs--;
+		scullc_dedup_saved += sizeof(*sq);
+		spin_unlock(&scullc_dedup_lock);
+		q = sq->data;
+		kfree(sq);
+		goto done;
+	}
+	spin_unlock(&scullc_dedup_lock);
+
+	q = kmem_cache_alloc(dev->cache, GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
+	/* the content of a shared quantum never changes: no lock needed */
+	memcpy(q, sq->data, dev->quantum);
+	scullc_dedup_put(sq);
+
+  done:
+	*slot = q;
+	dev->dquanta--;
+	dev->nquanta++;
+	return 0;
+}
+
+void scullc_dedup_show(struct seq_file *m)
+{
+	unsigned long objs;
+	long saved;
+
+	spin_lock(&scullc_dedup_lock);
+	objs = scullc_dedup_objs;
+	saved = scullc_dedup_saved;
+	spin_unlock(&scullc_dedup_lock);
+	seq_printf(m, "dedup: %lu shared quanta, %ld bytes saved\n",
+			objs, saved);
+}
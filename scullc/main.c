@@ -31,20 +31,26 @@
 #include <linux/uio.h>		/* struct iovec */
 #include <linux/version.h>
 #include <linux/mutex.h>
+#include <linux/jiffies.h>
 #include "scull-shared/scull-async.h"
 #include "scullc.h"		/* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
+#include "shrinker_version.h"
 
 int scullc_major =   SCULLC_MAJOR;
 int scullc_devs =    SCULLC_DEVS;	/* number of bare scullc devices */
 int scullc_qset =    SCULLC_QSET;
 int scullc_quantum = SCULLC_QUANTUM;
+int scullc_shrink =  SCULLC_SHRINK_NONE;	/* initial policy of all devices */
+int scullc_shrink_idle = 30;	/* seconds before a device counts as idle */
 
 module_param(scullc_major, int, 0);
 module_param(scullc_devs, int, 0);
 module_param(scullc_qset, int, 0);
 module_param(scullc_quantum, int, 0);
+module_param(scullc_shrink, int, 0);
+module_param(scullc_shrink_idle, int, 0644);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -53,8 +59,132 @@ struct scullc_dev *scullc_devices; /* allocated in scullc_init */
 int scullc_trim(struct scullc_dev *dev);
 void scullc_cleanup(void);
 
-/* declare one cache pointer: use it for all devices */
-struct kmem_cache *scullc_cache;
+/* one cache per size class, shared by all devices */
+static struct kmem_cache *scullc_caches[SCULLC_NR_CACHES];
+static char scullc_cache_names[SCULLC_NR_CACHES][16];
+
+/*
+ * Return the smallest size class that holds a quantum of the given size.
+ * The quantum must have been checked with scullc_quantum_ok() already.
+ */
+struct kmem_cache *scullc_cache_for(int quantum)
+{
+	int i = 0;
+
+	while ((1 << (SCULLC_CACHE_MIN_SHIFT + i)) < quantum)
+		i++;
+	return scullc_caches[i];
+}
+
+static inline int scullc_quantum_ok(int quantum)
+{
+	return quantum > 0 && quantum <= SCULLC_QUANTUM_MAX;
+}
+
+/*
+ * Release a quantum, whether it is compressed or not.
+ */
+void scullc_free_quantum(struct scullc_dev *dev, void *q)
+{
+	if (scullc_is_compressed(q))
+		kfree(scullc_zq(q));
+	else if (scullc_is_shared(q))
+		scullc_dedup_put(scullc_sq(q));
+	else
+		kmem_cache_free(dev->cache, q);
+}
+
+/*
+ * Memory pressure: idle devices give quanta back according to their
+ * own policy. Reclaim may run from our own allocations, with a device
+ * lock held, so we only ever try the locks and skip busy devices.
+ */
+static struct shrinker *scullc_shrinker;
+
+static int scullc_idle(struct scullc_dev *dev)
+{
+	return !dev->vmas &&
+		time_after(jiffies, dev->atime + scullc_shrink_idle * HZ);
+}
+
+static unsigned long scullc_shrink_count(struct shrinker *s,
+		struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	int i;
+
+	/* no locking: an estimate is all the VM asks for */
+	for (i = 0; i < scullc_devs; i++) {
+		struct scullc_dev *dev = scullc_devices + i;
+
+		if (READ_ONCE(dev->shrink) == SCULLC_SHRINK_NONE ||
+				!scullc_idle(dev))
+			continue;
+		count += READ_ONCE(dev->nquanta);
+		if (READ_ONCE(dev->shrink) == SCULLC_SHRINK_DISCARD)
+			count += READ_ONCE(dev->zquanta) +
+				READ_ONCE(dev->dquanta);
+	}
+	return count;
+}
+
+/* Free up to "nr" quanta that hold nothing but zeros */
+static unsigned long scullc_shrink_zero(struct scullc_dev *dev,
+		unsigned long nr)
+{
+	struct scullc_dev *dptr;
+	unsigned long freed = 0;
+	int i;
+
+	for (dptr = dev; dptr && freed < nr; dptr = dptr->next) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < dev->qset && freed < nr; i++) {
+			if (!dptr->data[i] ||
+					!scullc_is_plain(dptr->data[i]) ||
+					memchr_inv(dptr->data[i], 0, dev->quantum))
+				continue;
+			kmem_cache_free(dev->cache, dptr->data[i]);
+			dptr->data[i] = NULL;
+			freed++;
+		}
+	}
+	dev->nquanta -= freed;
+	return freed;
+}
+
+static unsigned long scullc_shrink_scan(struct shrinker *s,
+		struct shrink_control *sc)
+{
+	unsigned long freed = 0, n;
+	int i;
+
+	for (i = 0; i < scullc_devs && freed < sc->nr_to_scan; i++) {
+		struct scullc_dev *dev = scullc_devices + i;
+
+		if (!mutex_trylock(&dev->lock))
+			continue;
+		if (scullc_idle(dev)) {
+			switch (dev->shrink) {
+			case SCULLC_SHRINK_ZERO:
+				freed += scullc_shrink_zero(dev,
+						sc->nr_to_scan - freed);
+				break;
+			case SCULLC_SHRINK_DISCARD:
+				n = dev->nquanta + dev->zquanta + dev->dquanta;
+				if (scullc_trim(dev) == 0)
+					freed += n;
+				break;
+			case SCULLC_SHRINK_COMPRESS:
+				freed += scullc_compress_cold(dev,
+						sc->nr_to_scan - freed, 1);
+				break;
+			}
+		}
+		mutex_unlock(&dev->lock);
+	}
+	return freed ? freed : SHRINK_STOP;
+}
 
 
 
@@ -72,14 +202,25 @@ int scullc_read_procmem(struct seq_file *m, void *v)
 	int limit = m->size - 80; /* Don't print more than this */
 	struct scullc_dev *d;
 
+	scullc_dedup_show(m);
 	for(i = 0; i < scullc_devs; i++) {
 		d = &scullc_devices[i];
 		if (mutex_lock_interruptible (&d->lock))
 			return -ERESTARTSYS;
 		qset = d->qset;  /* retrieve the features of each device */
 		quantum=d->quantum;
-		seq_printf(m,"\nDevice %i: qset %i, quantum %i, sz %li\n",
-				i, qset, quantum, (long)(d->size));
+		seq_printf(m,"\nDevice %i: qset %i, quantum %i (slab %u), sz %li\n",
+				i, qset, quantum, kmem_cache_size(d->cache),
+				(long)(d->size));
+		seq_printf(m,"  shrink policy %i, %lu quanta\n",
+				d->shrink, d->nquanta);
+		seq_printf(m,"  compress %i: %lu quanta in %lu bytes, "
+				"ratio %lu%%, hits %lu, misses %lu\n",
+				d->compress, d->zquanta, d->zbytes,
+				d->zbytes ? d->zquanta * quantum * 100 / d->zbytes : 0,
+				d->zhits, d->zmisses);
+		seq_printf(m,"  dedup %i: %lu shared quanta in use\n",
+				d->dedup, d->dquanta);
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -170,14 +311,17 @@ ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
 {
 	struct scullc_dev *dev = filp->private_data; /* the first listitem */
 	struct scullc_dev *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
+	int quantum, qset;
+	int itemsize; /* how many bytes in the listitem */
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = 0;
 
 	if (mutex_lock_interruptible (&dev->lock))
 		return -ERESTARTSYS;
+	/* the quantum may change when the device is empty: read it locked */
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	if (*f_pos > dev->size) 
 		goto nothing;
 	if (*f_pos + count > dev->size)
@@ -190,17 +334,31 @@ ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullc_follow(dev, item);
 
-	if (!dptr->data)
-		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
-		goto nothing;
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* read only up to the end of this quantum */
 
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
+	if (!dptr->data || !dptr->data[s_pos]) {
+		/* a hole below "size" (maybe reclaimed zeros) reads as zeros */
+		if (clear_user(buf, count)) {
+			retval = -EFAULT;
+			goto nothing;
+		}
+		goto done;
+	}
+	if (scullc_is_compressed(dptr->data[s_pos])) {
+		dev->zmisses++;
+		retval = scullc_expand_quantum(dev, dptr->data + s_pos);
+		if (retval)
+			goto nothing;
+	} else
+		dev->zhits++;
+	set_bit(s_pos, dptr->hot);
+	if (copy_to_user (buf, scullc_qdata(dptr->data[s_pos])+q_pos, count)) {
 		retval = -EFAULT;
 		goto nothing;
 	}
+  done:
+	dev->atime = jiffies;
 	mutex_unlock (&dev->lock);
 
 	*f_pos += count;
@@ -218,14 +376,16 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 {
 	struct scullc_dev *dev = filp->private_data;
 	struct scullc_dev *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
+	int quantum, qset;
+	int itemsize;
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (mutex_lock_interruptible (&dev->lock))
 		return -ERESTARTSYS;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 
 	/* find listitem, qset index and offset in the quantum */
 	item = ((long) *f_pos) / itemsize;
@@ -239,21 +399,47 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 		if (!dptr->data)
 			goto nomem;
 		memset(dptr->data, 0, qset * sizeof(char *));
+		dptr->hot = kcalloc(BITS_TO_LONGS(qset), sizeof(long),
+				GFP_KERNEL);
+		if (!dptr->hot) {
+			kfree(dptr->data);
+			dptr->data = NULL;
+			goto nomem;
+		}
 	}
-	/* Allocate a quantum using the memory cache */
+	/* Allocate a quantum using the cache of this device's size class */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
+		dptr->data[s_pos] = kmem_cache_alloc(dev->cache, GFP_KERNEL);
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, scullc_quantum);
+		memset(dptr->data[s_pos], 0, quantum);
+		dev->nquanta++;
+	} else if (scullc_is_compressed(dptr->data[s_pos])) {
+		dev->zmisses++;
+		retval = scullc_expand_quantum(dev, dptr->data + s_pos);
+		if (retval)
+			goto nomem;
+	} else
+		dev->zhits++;
+	/* a shared quantum is copied before we change it */
+	if (scullc_is_shared(dptr->data[s_pos])) {
+		retval = scullc_unshare_quantum(dev, dptr->data + s_pos);
+		if (retval)
+			goto nomem;
 	}
+	set_bit(s_pos, dptr->hot);
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
 	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
 		retval = -EFAULT;
 		goto nomem;
 	}
+	/* a quantum just completed may be identical to another one */
+	if (dev->dedup && q_pos + count == quantum)
+		scullc_dedup_quantum(dev, (long)item * qset + s_pos,
+				dptr->data + s_pos); /* best effort */
 	*f_pos += count;
+	dev->atime = jiffies;
  
     	/* update the size */
 	if (dev->size < *f_pos)
@@ -266,6 +452,21 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 	return retval;
 }
 
+/*
+ * A device that holds no data takes new quantum and qset values at
+ * once; the others pick them up at the next trim, as before.
+ */
+static void scullc_adopt(struct scullc_dev *dev)
+{
+	mutex_lock(&dev->lock);
+	if (!dev->data && !dev->next && !dev->vmas) {
+		dev->quantum = scullc_quantum;
+		dev->qset = scullc_qset;
+		dev->cache = scullc_cache_for(scullc_quantum);
+	}
+	mutex_unlock(&dev->lock);
+}
+
 /*
  * The ioctl() implementation
  */
@@ -273,7 +474,8 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
-	int err = 0, ret = 0, tmp;
+	struct scullc_dev *dev = filp->private_data;
+	int err = 0, ret = 0, tmp, val;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLC_IOC_MAGIC) return -ENOTTY;
@@ -300,10 +502,16 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		break;
 
 	case SCULLC_IOCSQUANTUM: /* Set: arg points to the value */
-		ret = __get_user(scullc_quantum, (int __user *) arg);
+		ret = __get_user(val, (int __user *) arg);
+		if (ret == 0 && !scullc_quantum_ok(val))
+			return -EINVAL;
+		if (ret == 0)
+			scullc_quantum = val;
 		break;
 
 	case SCULLC_IOCTQUANTUM: /* Tell: arg is the value */
+		if (!scullc_quantum_ok(arg))
+			return -EINVAL;
 		scullc_quantum = arg;
 		break;
 
@@ -316,14 +524,21 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 
 	case SCULLC_IOCXQUANTUM: /* eXchange: use arg as pointer */
 		tmp = scullc_quantum;
-		ret = __get_user(scullc_quantum, (int __user *) arg);
-		if (ret == 0)
+		ret = __get_user(val, (int __user *) arg);
+		if (ret == 0 && !scullc_quantum_ok(val))
+			return -EINVAL;
+		if (ret == 0) {
+			scullc_quantum = val;
 			ret = __put_user(tmp, (int __user *) arg);
+		}
 		break;
 
 	case SCULLC_IOCHQUANTUM: /* sHift: like Tell + Query */
+		if (!scullc_quantum_ok(arg))
+			return -EINVAL;
 		tmp = scullc_quantum;
 		scullc_quantum = arg;
+		scullc_adopt(filp->private_data);
 		return tmp;
 
 	case SCULLC_IOCSQSET:
@@ -351,12 +566,44 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	case SCULLC_IOCHQSET:
 		tmp = scullc_qset;
 		scullc_qset = arg;
+		scullc_adopt(filp->private_data);
 		return tmp;
 
+	case SCULLC_IOCTSHRINK: /* Tell, but for this device only */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (arg > SCULLC_SHRINK_COMPRESS)
+			return -EINVAL;
+		if (arg == SCULLC_SHRINK_COMPRESS && !scullc_compress_available())
+			return -EOPNOTSUPP;
+		dev->shrink = arg;
+		return 0;
+
+	case SCULLC_IOCQSHRINK:
+		return dev->shrink;
+
+	case SCULLC_IOCTCOMPRESS:
+		if (arg && !scullc_compress_available())
+			return -EOPNOTSUPP;
+		dev->compress = !!arg;
+		return 0;
+
+	case SCULLC_IOCQCOMPRESS:
+		return dev->compress;
+
+	case SCULLC_IOCTDEDUP:
+		dev->dedup = !!arg;
+		return 0;
+
+	case SCULLC_IOCQDEDUP:
+		return dev->dedup;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
 
+	if (ret == 0 && _IOC_DIR(cmd) != _IOC_READ)
+		scullc_adopt(filp->private_data);
 	return ret;
 }
 
@@ -420,10 +667,12 @@ int scullc_trim(struct scullc_dev *dev)
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					kmem_cache_free(scullc_cache, dptr->data[i]);
+					scullc_free_quantum(dev, dptr->data[i]);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
+			kfree(dptr->hot);
+			dptr->hot = NULL;
 		}
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
@@ -431,6 +680,11 @@ int scullc_trim(struct scullc_dev *dev)
 	dev->size = 0;
 	dev->qset = scullc_qset;
 	dev->quantum = scullc_quantum;
+	dev->cache = scullc_cache_for(scullc_quantum);
+	dev->nquanta = 0;
+	dev->zquanta = 0;
+	dev->zbytes = 0;
+	dev->dquanta = 0;
 	dev->next = NULL;
 	return 0;
 }
@@ -471,6 +725,26 @@ int scullc_init(void)
 	if (result < 0)
 		return result;
 
+	if (!scullc_quantum_ok(scullc_quantum)) {
+		printk(KERN_NOTICE "scullc: bad quantum %i, using %i\n",
+				scullc_quantum, SCULLC_QUANTUM);
+		scullc_quantum = SCULLC_QUANTUM;
+	}
+
+	/*
+	 * Create the size-class caches before any device can use them.
+	 */
+	for (i = 0; i < SCULLC_NR_CACHES; i++) {
+		snprintf(scullc_cache_names[i], sizeof(scullc_cache_names[i]),
+				"scullc-%i", 1 << (SCULLC_CACHE_MIN_SHIFT + i));
+		scullc_caches[i] = kmem_cache_create(scullc_cache_names[i],
+				1 << (SCULLC_CACHE_MIN_SHIFT + i),
+				0, SLAB_HWCACHE_ALIGN, NULL); /* no ctor/dtor */
+		if (!scullc_caches[i]) {
+			result = -ENOMEM;
+			goto fail_cache;
+		}
+	}
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -479,29 +753,40 @@ int scullc_init(void)
 	scullc_devices = kmalloc(scullc_devs*sizeof (struct scullc_dev), GFP_KERNEL);
 	if (!scullc_devices) {
 		result = -ENOMEM;
-		goto fail_malloc;
+		goto fail_cache;
 	}
 	memset(scullc_devices, 0, scullc_devs*sizeof (struct scullc_dev));
 	for (i = 0; i < scullc_devs; i++) {
 		scullc_devices[i].quantum = scullc_quantum;
 		scullc_devices[i].qset = scullc_qset;
+		scullc_devices[i].cache = scullc_cache_for(scullc_quantum);
+		scullc_devices[i].shrink = scullc_shrink;
+		scullc_devices[i].compress = scullc_compress;
+		scullc_devices[i].dedup = scullc_dedup;
+		scullc_devices[i].atime = jiffies;
 		mutex_init (&scullc_devices[i].lock);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
-	scullc_cache = kmem_cache_create("scullc", scullc_quantum,
-			0, SLAB_HWCACHE_ALIGN, NULL); /* no ctor/dtor */
-	if (!scullc_cache) {
-		scullc_cleanup();
-		return -ENOMEM;
-	}
+	scullc_compress_init();
+	if (!scullc_compress_available())
+		for (i = 0; i < scullc_devs; i++)
+			scullc_devices[i].compress = 0;
+
+	scullc_shrinker = shrinker_create_wrapper("scullc",
+			scullc_shrink_count, scullc_shrink_scan);
+	if (!scullc_shrinker)
+		printk(KERN_NOTICE "scullc: can't register shrinker\n");
 
 #ifdef SCULLC_USE_PROC /* only when available */
 	proc_create("scullcmem", 0, NULL, proc_ops_wrapper(&scullc_proc_ops,scullc_pops));
 #endif
 	return 0; /* succeed */
 
-  fail_malloc:
+  fail_cache:
+	for (i = 0; i < SCULLC_NR_CACHES; i++)
+		if (scullc_caches[i])
+			kmem_cache_destroy(scullc_caches[i]);
 	unregister_chrdev_region(dev, scullc_devs);
 	return result;
 }
@@ -515,6 +800,8 @@ void scullc_cleanup(void)
 #ifdef SCULLC_USE_PROC
 	remove_proc_entry("scullcmem", NULL);
 #endif
+	shrinker_destroy_wrapper(scullc_shrinker);
+	scullc_compress_cleanup();
 
 	for (i = 0; i < scullc_devs; i++) {
 		cdev_del(&scullc_devices[i].cdev);
@@ -522,8 +809,9 @@ void scullc_cleanup(void)
 	}
 	kfree(scullc_devices);
 
-	if (scullc_cache)
-		kmem_cache_destroy(scullc_cache);
+	for (i = 0; i < SCULLC_NR_CACHES; i++)
+		if (scullc_caches[i])
+			kmem_cache_destroy(scullc_caches[i]);
 	unregister_chrdev_region(MKDEV (scullc_major, 0), scullc_devs);
 }
 
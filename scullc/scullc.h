@@ -52,17 +52,106 @@
 #define SCULLC_QUANTUM  4000 /* use a quantum size like scull */
 #define SCULLC_QSET     500
 
+/*
+ * Quanta come from a set of power-of-two size-class caches, from
+ * 256 bytes to 64kB, so each device can use its own quantum size.
+ */
+#define SCULLC_CACHE_MIN_SHIFT  8
+#define SCULLC_CACHE_MAX_SHIFT  16
+#define SCULLC_NR_CACHES   (SCULLC_CACHE_MAX_SHIFT - SCULLC_CACHE_MIN_SHIFT + 1)
+#define SCULLC_QUANTUM_MAX (1 << SCULLC_CACHE_MAX_SHIFT)
+
 struct scullc_dev {
 	void **data;
 	struct scullc_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
 	int quantum;              /* the current allocation size */
 	int qset;                 /* the current array size */
+	struct kmem_cache *cache; /* size class holding "quantum" */
+	int shrink;               /* reclaim policy, see below */
+	unsigned long atime;      /* jiffies at the last read or write */
+	unsigned long nquanta;    /* plain quanta allocated to the device */
+	unsigned long *hot;       /* quanta used since the last cold scan */
+	int compress;             /* compress cold quanta in the background */
+	unsigned long zquanta;    /* compressed quanta ... */
+	unsigned long zbytes;     /* ... and the bytes they take */
+	unsigned long zhits;      /* accesses to plain quanta */
+	unsigned long zmisses;    /* accesses that had to decompress */
+	int dedup;                /* share identical full quanta */
+	unsigned long dquanta;    /* slots pointing to shared quanta */
 	size_t size;              /* 32-bit will suffice */
 	struct mutex lock;     /* Mutual exclusion */
 	struct cdev cdev;
 };
 
+/*
+ * What the shrinker may do with an idle device under memory pressure.
+ */
+#define SCULLC_SHRINK_NONE     0 /* refuse: keep every quantum */
+#define SCULLC_SHRINK_ZERO     1 /* free quanta holding only zeros */
+#define SCULLC_SHRINK_DISCARD  2 /* drop all the data, like a cache */
+#define SCULLC_SHRINK_COMPRESS 3 /* compress quanta, see compress.c */
+
+/*
+ * A compressed quantum lives in a kmalloc buffer.  It is stored in the
+ * quantum set with the low bit of the pointer set: slab objects are
+ * word aligned, so plain quanta never have it.
+ */
+struct scullc_zquantum {
+	unsigned int len;
+	u8 data[];
+};
+
+#define SCULLC_ZTAG 1UL
+
+static inline int scullc_is_compressed(void *q)
+{
+	return (unsigned long)q & SCULLC_ZTAG;
+}
+
+static inline struct scullc_zquantum *scullc_zq(void *q)
+{
+	return (struct scullc_zquantum *)((unsigned long)q & ~SCULLC_ZTAG);
+}
+
+/*
+ * Identical quanta can be shared, see dedup.c.  A shared quantum is
+ * read-only and refcounted; slots referring to it have the second bit
+ * of the pointer set.
+ */
+struct scullc_shared {
+	struct hlist_node node;   /* in the dedup hash table */
+	u64 hash;
+	int quantum;
+	int refs;
+	struct kmem_cache *cache;
+	void *data;
+};
+
+#define SCULLC_DTAG 2UL
+
+static inline int scullc_is_shared(void *q)
+{
+	return (unsigned long)q & SCULLC_DTAG;
+}
+
+static inline struct scullc_shared *scullc_sq(void *q)
+{
+	return (struct scullc_shared *)((unsigned long)q & ~SCULLC_DTAG);
+}
+
+/* neither compressed nor shared: a quantum we can modify in place */
+static inline int scullc_is_plain(void *q)
+{
+	return !((unsigned long)q & (SCULLC_ZTAG | SCULLC_DTAG));
+}
+
+/* the data of a plain or shared quantum */
+static inline void *scullc_qdata(void *q)
+{
+	return scullc_is_shared(q) ? scullc_sq(q)->data : q;
+}
+
 extern struct scullc_dev *scullc_devices;
 
 extern struct file_operations scullc_fops;
@@ -72,14 +161,35 @@ extern struct file_operations scullc_fops;
  */
 extern int scullc_major;     /* main.c */
 extern int scullc_devs;
-extern int scullc_order;
+extern int scullc_quantum;
 extern int scullc_qset;
+extern int scullc_shrink;
+extern int scullc_shrink_idle;
+extern int scullc_compress;  /* compress.c */
+extern int scullc_comp_interval;
+extern int scullc_dedup;     /* dedup.c */
 
 /*
  * Prototypes for shared functions
  */
 int scullc_trim(struct scullc_dev *dev);
 struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
+struct kmem_cache *scullc_cache_for(int quantum);
+void scullc_free_quantum(struct scullc_dev *dev, void *q);
+
+void scullc_compress_init(void);
+void scullc_compress_cleanup(void);
+int scullc_compress_available(void);
+int scullc_compress_quantum(struct scullc_dev *dev, void **slot, int reclaim);
+int scullc_expand_quantum(struct scullc_dev *dev, void **slot);
+unsigned long scullc_compress_cold(struct scullc_dev *dev, unsigned long nr,
+		int reclaim);
+
+struct seq_file;
+int scullc_dedup_quantum(struct scullc_dev *dev, long index, void **slot);
+int scullc_unshare_quantum(struct scullc_dev *dev, void **slot);
+void scullc_dedup_put(struct scullc_shared *sq);
+void scullc_dedup_show(struct seq_file *m);
 
 
 #ifdef SCULLC_DEBUG
@@ -116,7 +226,19 @@ struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 #define SCULLC_IOCXQSET    _IOWR(SCULLC_IOC_MAGIC,11, int)
 #define SCULLC_IOCHQSET    _IO(SCULLC_IOC_MAGIC,  12)
 
-#define SCULLC_IOC_MAXNR 12
+/* Reclaim policy of the device the ioctl is issued on */
+#define SCULLC_IOCTSHRINK  _IO(SCULLC_IOC_MAGIC,  13)
+#define SCULLC_IOCQSHRINK  _IO(SCULLC_IOC_MAGIC,  14)
+
+/* Background compression of cold quanta, also per device */
+#define SCULLC_IOCTCOMPRESS _IO(SCULLC_IOC_MAGIC, 15)
+#define SCULLC_IOCQCOMPRESS _IO(SCULLC_IOC_MAGIC, 16)
+
+/* Sharing of identical quanta, per device */
+#define SCULLC_IOCTDEDUP   _IO(SCULLC_IOC_MAGIC,  17)
+#define SCULLC_IOCQDEDUP   _IO(SCULLC_IOC_MAGIC,  18)
+
+#define SCULLC_IOC_MAXNR 18
 
 
 
@@ -0,0 +1,227 @@
+/*  -*- C -*-
+ * dma.c -- asynchronous reads through the LDD copy engine
+ *
+ * An asynchronous read (io_submit) of at least sculld_dma_min bytes
+ * pins the user buffer, describes the copy from the device pages to
+ * the user pages for the copy engine, and returns -EIOCBQUEUED. The
+ * engine's completion schedules the end of the work, which releases
+ * the pages and completes the iocb, as a driver's bottom half would.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+#include "sculld.h"		/* local definitions */
+#include "lddcopy.h"
+
+int sculld_dma = 0;			/* offload asynchronous reads */
+int sculld_dma_min = 4 * PAGE_SIZE;	/* smaller reads are just copied */
+
+module_param(sculld_dma, int, 0644);
+module_param(sculld_dma_min, int, 0644);
+
+/*
+ * The ends of the reads run from our own workqueue, so that cleanup
+ * can wait for the last of them to return before the module goes.
+ */
+static struct workqueue_struct *sculld_dma_wq;
+
+struct sculld_dma_req {
+	struct kiocb *iocb;
+	struct sculld_dev *dev;
+	size_t count;
+	int npages;
+	struct page *pages[SCULLD_DMA_PAGES];
+	struct work_struct work;
+	/* a user page may take two device pages, plus one for the start */
+	struct ldd_copy_desc descs[2 * SCULLD_DMA_PAGES + 1];
+};
+
+static void sculld_dma_put_pages(struct sculld_dma_req *req, int dirty)
+{
+	int i;
+
+	for (i = 0; i < req->npages; i++) {
+		if (dirty)
+			set_page_dirty_lock(req->pages[i]);
+		put_page(req->pages[i]);
+	}
+}
+
+static void sculld_dma_finish(struct work_struct *work)
+{
+	struct sculld_dma_req *req = container_of(work, struct sculld_dma_req, work);
+	struct kiocb *iocb = req->iocb;
+	struct sculld_dev *dev = req->dev;
+
+	sculld_dma_put_pages(req, 1);
+	iocb->ki_pos += req->count;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+	iocb->ki_complete(iocb, req->count, 0);
+#else
+	iocb->ki_complete(iocb, req->count);
+#endif
+	kfree(req);
+	if (atomic_dec_and_test(&dev->dma_pending))
+		wake_up(&dev->dma_wait);
+}
+
+/* the "interrupt handler" can't sleep: defer the rest */
+static void sculld_dma_done(void *context, int status)
+{
+	struct sculld_dma_req *req = context;
+
+	queue_work(sculld_dma_wq, &req->work);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+static ssize_t sculld_get_pages(struct iov_iter *iter, struct page **pages,
+		size_t maxsize, unsigned int maxpages, size_t *start)
+{
+	ssize_t ret = iov_iter_get_pages(iter, pages, maxsize, maxpages, start);
+
+	if (ret > 0)
+		iov_iter_advance(iter, ret);
+	return ret;
+}
+#else
+#define sculld_get_pages iov_iter_get_pages2
+#endif
+
+/*
+ * Describe the copy of req->count bytes from "pos" in the device to
+ * the user pages, starting at "uoff" in the first one. Stops at a
+ * hole; returns the number of descriptors and trims req->count to
+ * what they cover. Called with the device mutex held.
+ */
+static int sculld_dma_describe(struct sculld_dma_req *req, loff_t pos,
+		size_t uoff)
+{
+	struct sculld_dev *dptr, *dev = req->dev;
+	int quantum = PAGE_SIZE << dev->order;
+	int itemsize = quantum * dev->qset;
+	size_t left = req->count, len;
+	int n = 0, upage = 0, item, s_pos, q_pos, rest;
+	void *src;
+
+	while (left) {
+		item = (long)pos / itemsize;
+		rest = (long)pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+		dptr = sculld_follow(dev, item);
+		if (!dptr || !dptr->data || !dptr->data[s_pos])
+			break; /* don't fill holes */
+		src = dptr->data[s_pos] + q_pos;
+		len = min3(left, PAGE_SIZE - offset_in_page(src),
+				PAGE_SIZE - uoff);
+		req->descs[n].src = virt_to_page(src);
+		req->descs[n].src_off = offset_in_page(src);
+		req->descs[n].dst = req->pages[upage];
+		req->descs[n].dst_off = uoff;
+		req->descs[n].len = len;
+		req->descs[n].callback = NULL;
+		n++;
+		uoff += len;
+		if (uoff == PAGE_SIZE) {
+			upage++;
+			uoff = 0;
+		}
+		pos += len;
+		left -= len;
+	}
+	req->count -= left;
+	if (n) {
+		req->descs[n - 1].callback = sculld_dma_done;
+		req->descs[n - 1].context = req;
+	}
+	return n;
+}
+
+/*
+ * Start an asynchronous read. Returns -EOPNOTSUPP for buffers the
+ * engine can't reach (not in user memory), so that the caller copies
+ * them itself.
+ */
+ssize_t sculld_dma_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+	struct sculld_dma_req *req;
+	loff_t pos = iocb->ki_pos;
+	size_t uoff;
+	ssize_t got;
+	int n, err;
+
+	if (!sculld_dma_wq || ldd_copy_max_descs() < ARRAY_SIZE(req->descs))
+		return -EOPNOTSUPP; /* a request may not fit in the ring */
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->iocb = iocb;
+	req->dev = dev;
+	INIT_WORK(&req->work, sculld_dma_finish);
+
+	/* pin the buffer first: it may fault, and the fault takes the mutex */
+	got = sculld_get_pages(to, req->pages, iov_iter_count(to),
+			SCULLD_DMA_PAGES, &uoff);
+	if (got <= 0) {
+		kfree(req);
+		return -EOPNOTSUPP;
+	}
+	req->npages = DIV_ROUND_UP(uoff + got, PAGE_SIZE);
+	req->count = got;
+
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		err = -ERESTARTSYS;
+		goto out_pages;
+	}
+	err = 0;
+	if (pos >= dev->size)
+		goto out_unlock; /* end of file */
+	if (req->count > dev->size - pos)
+		req->count = dev->size - pos;
+
+	n = sculld_dma_describe(req, pos, uoff);
+	if (!n)
+		goto out_unlock; /* a hole: nothing to read */
+	atomic_inc(&dev->dma_pending);
+	err = ldd_copy_submit(req->descs, n);
+	if (err) {
+		atomic_dec(&dev->dma_pending);
+		goto out_unlock;
+	}
+	dev->rbytes += req->count;
+	mutex_unlock(&dev->mutex);
+	return -EIOCBQUEUED;
+
+  out_unlock:
+	mutex_unlock(&dev->mutex);
+  out_pages:
+	sculld_dma_put_pages(req, 0);
+	kfree(req);
+	return err;
+}
+
+/* without the workqueue, all reads are copied by the CPU */
+void sculld_dma_init(void)
+{
+	sculld_dma_wq = alloc_workqueue("sculld_dma", 0, 0);
+}
+
+/* the devices are gone, and trim waited for their reads */
+void sculld_dma_cleanup(void)
+{
+	if (sculld_dma_wq)
+		destroy_workqueue(sculld_dma_wq);
+}
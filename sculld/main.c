@@ -28,6 +28,7 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
 #include "scull-shared/scull-async.h"
 #include "sculld.h"		/* local definitions */
 #include "access_ok_version.h"
@@ -36,15 +37,22 @@ int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
 int sculld_qset =    SCULLD_QSET;
 int sculld_order =   SCULLD_ORDER;
+int sculld_max_devs = SCULLD_MAX_DEVS;	/* devices added at run time too */
+int sculld_async =   1;	/* probe the devices in parallel */
 
 module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
+module_param(sculld_max_devs, int, 0);
+module_param(sculld_async, int, 0);
 module_param(sculld_qset, int, 0);
 module_param(sculld_order, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct sculld_dev *sculld_devices; /* allocated in sculld_init */
+static DEFINE_MUTEX(sculld_devs_lock); /* serializes adding and removing */
+static ktime_t sculld_load_start;	/* to time the probing */
+static atomic_t sculld_probed = ATOMIC_INIT(0);
 
 int sculld_trim(struct sculld_dev *dev);
 void sculld_cleanup(void);
@@ -53,12 +61,21 @@ void sculld_cleanup(void);
 
 /* Device model stuff */
 
+static int sculld_new_device(struct ldd_driver *driver);
+static int sculld_delete_device(struct ldd_device *ldev);
+static int sculld_probe(struct ldd_device *ldev);
+static void sculld_remove(struct ldd_device *ldev);
+
 static struct ldd_driver sculld_driver = {
 	.version = "$Revision: 1.21 $",
 	.module = THIS_MODULE,
 	.driver = {
 		.name = "sculld",
 	},
+	.new_device = sculld_new_device,
+	.delete_device = sculld_delete_device,
+	.probe = sculld_probe,
+	.remove = sculld_remove,
 };
 
 
@@ -75,10 +92,14 @@ int sculld_read_procmem(struct seq_file *m, void *v)
 	int limit = m->size - 80; /* Don't print more than this */
 	struct sculld_dev *d;
 
-	for(i = 0; i < sculld_devs; i++) {
+	for(i = 0; i < sculld_max_devs; i++) {
 		d = &sculld_devices[i];
 		if (mutex_lock_interruptible (&d->mutex))
 			return -ERESTARTSYS;
+		if (!d->present) {
+			mutex_unlock(&d->mutex);
+			continue;
+		}
 		qset = d->qset;  /* retrieve the features of each device */
 		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
@@ -127,15 +148,21 @@ int sculld_open (struct inode *inode, struct file *filp)
 	struct sculld_dev *dev; /* device information */
 
 	/*  Find the device */
-	dev = container_of(inode->i_cdev, struct sculld_dev, cdev);
+	dev = sculld_devices + iminor(inode); /* the cdev may be gone */
 
-    	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->mutex))
-			return -ERESTARTSYS;
-		sculld_trim(dev); /* ignore errors */
+	/* count the users, so that the device can't go away under them */
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	if (!dev->present) {
 		mutex_unlock(&dev->mutex);
+		return -ENODEV;
 	}
+	dev->users++;
+
+    	/* now trim to 0 the length of the device if open was write-only */
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
+		sculld_trim(dev); /* ignore errors */
+	mutex_unlock(&dev->mutex);
 
 	/* and use filp->private_data to point to the device data */
 	filp->private_data = dev;
@@ -145,6 +172,11 @@ int sculld_open (struct inode *inode, struct file *filp)
 
 int sculld_release (struct inode *inode, struct file *filp)
 {
+	struct sculld_dev *dev = filp->private_data;
+
+	mutex_lock(&dev->mutex);
+	dev->users--;
+	mutex_unlock(&dev->mutex);
 	return 0;
 }
 
@@ -204,6 +236,7 @@ ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
 		retval = -EFAULT;
 		goto nothing;
 	}
+	dev->rbytes += count;
 	mutex_unlock(&dev->mutex);
 
 	*f_pos += count;
@@ -250,6 +283,7 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 		if (!dptr->data[s_pos])
 			goto nomem;
 		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+		dev->nquanta++;
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -258,6 +292,7 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 		goto nomem;
 	}
 	*f_pos += count;
+	dev->wbytes += count;
  
     	/* update the size */
 	if (dev->size < *f_pos)
@@ -364,6 +399,23 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/*
+ * Asynchronous reads that are large enough go to the copy engine,
+ * when enabled; anything else takes the common path.
+ */
+ssize_t sculld_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+
+	if (!is_sync_kiocb(iocb) && READ_ONCE(sculld_dma) &&
+			iov_iter_count(to) >= READ_ONCE(sculld_dma_min)) {
+		ret = sculld_dma_read(iocb, to);
+		if (ret != -EOPNOTSUPP)
+			return ret;
+	}
+	return scull_read_iter(iocb, to);
+}
+
 /*
  * The "extended" operations
  */
@@ -414,7 +466,7 @@ struct file_operations sculld_fops = {
 	.mmap =	     sculld_mmap,
 	.open =	     sculld_open,
 	.release =   sculld_release,
-	.read_iter =  scull_read_iter,
+	.read_iter =  sculld_read_iter,
 	.write_iter = scull_write_iter,
 };
 
@@ -426,6 +478,8 @@ int sculld_trim(struct sculld_dev *dev)
 
 	if (dev->vmas) /* don't trim: there are active mappings */
 		return -EBUSY;
+	/* the copy engine may still be reading our pages */
+	wait_event(dev->dma_wait, !atomic_read(&dev->dma_pending));
 
 	for (dptr = dev; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
@@ -442,42 +496,295 @@ int sculld_trim(struct sculld_dev *dev)
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
 	dev->size = 0;
-	dev->qset = sculld_qset;
-	dev->order = sculld_order;
+	dev->nquanta = 0;
+	if (!dev->tuned) { /* else keep what was set through sysfs */
+		dev->qset = sculld_qset;
+		dev->order = sculld_order;
+	}
 	dev->next = NULL;
 	return 0;
 }
 
 
-static void sculld_setup_cdev(struct sculld_dev *dev, int index)
+/*
+ * The char device is allocated anew at every binding: files opened
+ * through the previous one keep it until they are closed, so the
+ * driver can be unbound and bound again while the device is open.
+ */
+static int sculld_setup_cdev(struct sculld_dev *dev, int index)
 {
 	int err, devno = MKDEV(sculld_major, index);
-    
-	cdev_init(&dev->cdev, &sculld_fops);
-	dev->cdev.owner = THIS_MODULE;
-	err = cdev_add (&dev->cdev, devno, 1);
+	struct cdev *cdev = cdev_alloc();
+
+	if (!cdev)
+		return -ENOMEM;
+	cdev->ops = &sculld_fops;
+	cdev->owner = THIS_MODULE;
+	err = cdev_add (cdev, devno, 1);
 	/* Fail gracefully if need be */
-	if (err)
+	if (err) {
 		printk(KERN_NOTICE "Error %d adding scull%d", err, index);
+		kobject_put(&cdev->kobj);
+		return err;
+	}
+	dev->cdev = cdev;
+	return 0;
 }
 
+/*
+ * The sysfs attributes of every device: its number, its layout and
+ * a few statistics. They exist before the driver binds, so they don't
+ * rely on the driver data.
+ */
+#define to_sculld_dev(ddev) ((struct sculld_dev *) to_ldd_device(ddev)->data)
+
 static ssize_t sculld_show_dev(struct device *ddev, struct device_attribute *attr, char *buf)
 {
-	struct sculld_dev *dev = dev_get_drvdata(ddev);
+	struct sculld_dev *dev = to_sculld_dev(ddev);
 
-	return print_dev_t(buf, dev->cdev.dev);
+	return print_dev_t(buf, MKDEV(sculld_major, dev - sculld_devices));
 }
 
 static DEVICE_ATTR(dev, S_IRUGO, sculld_show_dev, NULL);
 
-static void sculld_register_dev(struct sculld_dev *dev, int index)
+#define SCULLD_SHOW(field, fmt)						\
+static ssize_t field##_show(struct device *ddev,			\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct sculld_dev *dev = to_sculld_dev(ddev);			\
+									\
+	return sprintf(buf, fmt "\n", dev->field);			\
+}
+
+SCULLD_SHOW(order, "%i")
+SCULLD_SHOW(qset, "%i")
+SCULLD_SHOW(size, "%zu")
+SCULLD_SHOW(nquanta, "%lu")
+SCULLD_SHOW(rbytes, "%lu")
+SCULLD_SHOW(wbytes, "%lu")
+
+/*
+ * The layout of a device can only change while it holds no data.
+ * A negative value returns it to the module-wide setting.
+ */
+static ssize_t sculld_set_layout(struct device *ddev, const char *buf,
+		size_t count, int is_order)
+{
+	struct sculld_dev *dev = to_sculld_dev(ddev);
+	int val, ret;
+
+	ret = kstrtoint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if ((is_order && val > SCULLD_MAX_ORDER) || (!is_order && val == 0))
+		return -EINVAL;
+	mutex_lock(&dev->mutex);
+	if (dev->size || dev->data) {
+		mutex_unlock(&dev->mutex);
+		return -EBUSY;
+	}
+	if (val < 0) {
+		dev->tuned = 0;
+		dev->order = sculld_order;
+		dev->qset = sculld_qset;
+	} else {
+		dev->tuned = 1;
+		if (is_order)
+			dev->order = val;
+		else
+			dev->qset = val;
+	}
+	mutex_unlock(&dev->mutex);
+	return count;
+}
+
+static ssize_t order_store(struct device *ddev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	return sculld_set_layout(ddev, buf, count, 1);
+}
+
+static ssize_t qset_store(struct device *ddev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	return sculld_set_layout(ddev, buf, count, 0);
+}
+
+static DEVICE_ATTR_RW(order);
+static DEVICE_ATTR_RW(qset);
+static DEVICE_ATTR_RO(size);
+static DEVICE_ATTR(quanta, S_IRUGO, nquanta_show, NULL);
+static DEVICE_ATTR(read_bytes, S_IRUGO, rbytes_show, NULL);
+static DEVICE_ATTR(write_bytes, S_IRUGO, wbytes_show, NULL);
+
+static struct attribute *sculld_attrs[] = {
+	&dev_attr_dev.attr,
+	&dev_attr_order.attr,
+	&dev_attr_qset.attr,
+	&dev_attr_size.attr,
+	&dev_attr_quanta.attr,
+	&dev_attr_read_bytes.attr,
+	&dev_attr_write_bytes.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(sculld);
+
+/*
+ * Binding: the char device is only set up when the driver binds the
+ * bus device, which may happen in parallel for all of them, and after
+ * the module init is done (sculld_async).
+ */
+static int sculld_probe(struct ldd_device *ldev)
+{
+	struct sculld_dev *dev = ldev->data;
+	int err;
+
+	dev_set_drvdata(&ldev->dev, dev);
+	err = sculld_setup_cdev(dev, dev - sculld_devices);
+	if (!err && atomic_inc_return(&sculld_probed) == sculld_devs)
+		printk(KERN_INFO "sculld: %i devices probed in %lli us\n",
+				sculld_devs, ktime_us_delta(ktime_get(),
+				sculld_load_start));
+	return err;
+}
+
+static void sculld_remove(struct ldd_device *ldev)
+{
+	struct sculld_dev *dev = ldev->data;
+
+	cdev_del(dev->cdev); /* no new opens; open files keep working */
+	dev->cdev = NULL;
+}
+
+/*
+ * Claim slot "index" and get a bus device ready for registration. The
+ * bus device is a new one every time: the previous one of the slot
+ * may still be referenced, and goes away with its last reference.
+ * Called with sculld_devs_lock held.
+ */
+static int sculld_prepare_dev(struct sculld_dev *dev, int index)
+{
+	struct ldd_device *ldev;
+	char name[20];
+
+	snprintf(name, sizeof(name), "sculld%d", index);
+	ldev = ldd_alloc_device(name);
+	if (!ldev)
+		return -ENOMEM;
+	ldev->driver = &sculld_driver;
+	ldev->data = dev;
+	ldev->dev.groups = sculld_groups;
+
+	mutex_lock(&dev->mutex);
+	dev->ldev = ldev;
+	dev->present = 1;
+	dev->order = sculld_order;
+	dev->qset = sculld_qset;
+	dev->tuned = 0;
+	dev->nquanta = dev->rbytes = dev->wbytes = 0;
+	mutex_unlock(&dev->mutex);
+	return 0;
+}
+
+/* the registration failed: give the slot back */
+static void sculld_release_dev(struct sculld_dev *dev)
 {
-	snprintf(dev->devname, sizeof(dev->devname), "sculld%d", index);
-	dev->ldev.name = dev->devname;
-	dev->ldev.driver = &sculld_driver;
-	dev_set_drvdata(&dev->ldev.dev, dev);
-	register_ldd_device(&dev->ldev);
-	device_create_file(&dev->ldev.dev, &dev_attr_dev);
+	put_device(&dev->ldev->dev); /* and free it */
+	mutex_lock(&dev->mutex);
+	dev->ldev = NULL;
+	dev->present = 0;
+	mutex_unlock(&dev->mutex);
+}
+
+static int sculld_register_dev(struct sculld_dev *dev, int index)
+{
+	int err;
+
+	err = sculld_prepare_dev(dev, index);
+	if (err)
+		return err;
+	err = register_ldd_device(dev->ldev);
+	if (err)
+		sculld_release_dev(dev);
+	return err;
+}
+
+/*
+ * The devices present at load time are registered all at once, in
+ * parallel.
+ */
+static void sculld_register_all(int n)
+{
+	struct ldd_device **ldevs;
+	int i, k, *errs;
+
+	ldevs = kcalloc(n, sizeof(*ldevs), GFP_KERNEL);
+	errs = kcalloc(n, sizeof(*errs), GFP_KERNEL);
+	if (!ldevs || !errs) {
+		for (i = 0; i < n; i++)
+			sculld_register_dev(sculld_devices + i, i);
+		goto out;
+	}
+	for (i = 0, k = 0; i < n; i++)
+		if (!sculld_prepare_dev(sculld_devices + i, i))
+			ldevs[k++] = sculld_devices[i].ldev;
+	register_ldd_devices(ldevs, errs, k);
+	for (i = 0; i < k; i++)
+		if (errs[i])
+			sculld_release_dev(ldevs[i]->data);
+  out:
+	kfree(errs);
+	kfree(ldevs);
+}
+
+/*
+ * Take a device down, unless it is in use. Called with
+ * sculld_devs_lock held.
+ */
+static int sculld_unregister_dev(struct sculld_dev *dev)
+{
+	mutex_lock(&dev->mutex);
+	if (dev->users) {
+		mutex_unlock(&dev->mutex);
+		return -EBUSY;
+	}
+	dev->present = 0;
+	mutex_unlock(&dev->mutex);
+
+	unregister_ldd_device(dev->ldev); /* and sculld_remove() */
+	dev->ldev = NULL;
+	sculld_trim(dev);
+	return 0;
+}
+
+/*
+ * Run-time management, through the new_device and delete_device
+ * attributes of the bus: a new device takes the first free slot.
+ */
+static int sculld_new_device(struct ldd_driver *driver)
+{
+	int i, err = -ENOSPC;
+
+	mutex_lock(&sculld_devs_lock);
+	for (i = 0; i < sculld_max_devs; i++)
+		if (!sculld_devices[i].present) {
+			err = sculld_register_dev(sculld_devices + i, i);
+			break;
+		}
+	mutex_unlock(&sculld_devs_lock);
+	return err;
+}
+
+static int sculld_delete_device(struct ldd_device *ldev)
+{
+	struct sculld_dev *dev = ldev->data;
+	int err = -ENODEV;
+
+	mutex_lock(&sculld_devs_lock);
+	if (dev->present && dev->ldev == ldev)
+		err = sculld_unregister_dev(dev);
+	mutex_unlock(&sculld_devs_lock);
+	return err;
 }
 
 
@@ -493,37 +800,47 @@ int sculld_init(void)
 	/*
 	 * Register your major, and accept a dynamic number.
 	 */
+	if (sculld_max_devs < sculld_devs)
+		sculld_max_devs = sculld_devs;
 	if (sculld_major)
-		result = register_chrdev_region(dev, sculld_devs, "sculld");
+		result = register_chrdev_region(dev, sculld_max_devs, "sculld");
 	else {
-		result = alloc_chrdev_region(&dev, 0, sculld_devs, "sculld");
+		result = alloc_chrdev_region(&dev, 0, sculld_max_devs, "sculld");
 		sculld_major = MAJOR(dev);
 	}
 	if (result < 0)
 		return result;
 
-	/*
-	 * Register with the driver core.
-	 */
-	register_ldd_driver(&sculld_driver);
-	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
 	 */
-	sculld_devices = kmalloc(sculld_devs*sizeof (struct sculld_dev), GFP_KERNEL);
+	sculld_devices = kmalloc(sculld_max_devs*sizeof (struct sculld_dev), GFP_KERNEL);
 	if (!sculld_devices) {
 		result = -ENOMEM;
 		goto fail_malloc;
 	}
-	memset(sculld_devices, 0, sculld_devs*sizeof (struct sculld_dev));
-	for (i = 0; i < sculld_devs; i++) {
-		sculld_devices[i].order = sculld_order;
-		sculld_devices[i].qset = sculld_qset;
+	memset(sculld_devices, 0, sculld_max_devs*sizeof (struct sculld_dev));
+	for (i = 0; i < sculld_max_devs; i++) {
 		mutex_init(&sculld_devices[i].mutex);
-		sculld_setup_cdev(sculld_devices + i, i);
-		sculld_register_dev(sculld_devices + i, i);
+		init_waitqueue_head(&sculld_devices[i].dma_wait);
 	}
+	sculld_dma_init();
+
+	/*
+	 * Register with the driver core, last: from then on, devices can
+	 * be added through the bus.
+	 */
+	sculld_load_start = ktime_get();
+	sculld_driver.prefer_async = sculld_async;
+	result = register_ldd_driver(&sculld_driver);
+	if (result)
+		goto fail_driver;
+	mutex_lock(&sculld_devs_lock);
+	sculld_register_all(sculld_devs);
+	mutex_unlock(&sculld_devs_lock);
+	printk(KERN_INFO "sculld: %i devices registered in %lli us\n",
+			sculld_devs, ktime_us_delta(ktime_get(), sculld_load_start));
 
 
 #ifdef SCULLD_USE_PROC /* only when available */
@@ -531,8 +848,11 @@ int sculld_init(void)
 #endif
 	return 0; /* succeed */
 
+  fail_driver:
+	sculld_dma_cleanup();
+	kfree(sculld_devices);
   fail_malloc:
-	unregister_chrdev_region(dev, sculld_devs);
+	unregister_chrdev_region(dev, sculld_max_devs);
 	return result;
 }
 
@@ -546,14 +866,16 @@ void sculld_cleanup(void)
 	remove_proc_entry("sculldmem", NULL);
 #endif
 
-	for (i = 0; i < sculld_devs; i++) {
-		unregister_ldd_device(&sculld_devices[i].ldev);
-		cdev_del(&sculld_devices[i].cdev);
-		sculld_trim(sculld_devices + i);
-	}
+	/* no file is open, or we would not be unloaded */
+	mutex_lock(&sculld_devs_lock);
+	for (i = 0; i < sculld_max_devs; i++)
+		if (sculld_devices[i].present)
+			sculld_unregister_dev(sculld_devices + i);
+	mutex_unlock(&sculld_devs_lock);
+	sculld_dma_cleanup(); /* the last read ends */
 	kfree(sculld_devices);
 	unregister_ldd_driver(&sculld_driver);
-	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_devs);
+	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_max_devs);
 }
 
 
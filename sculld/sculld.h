@@ -16,6 +16,7 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/wait.h>
 #include "../include/lddbus.h"
 
 /*
@@ -41,6 +42,7 @@
 #define SCULLD_MAJOR 0   /* dynamic major by default */
 
 #define SCULLD_DEVS 4    /* sculld0 through sculld3 */
+#define SCULLD_MAX_DEVS 64 /* room for devices added at run time */
 
 /*
  * The bare device is a variable-length region of memory.
@@ -53,6 +55,8 @@
  */
 #define SCULLD_ORDER    0 /* one page at a time */
 #define SCULLD_QSET     500
+#define SCULLD_MAX_ORDER 10 /* as far as the buddy allocator goes */
+#define SCULLD_DMA_PAGES 32 /* user pages in a copy engine request */
 
 struct sculld_dev {
 	void **data;
@@ -62,9 +66,15 @@ struct sculld_dev {
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
 	struct mutex mutex;     /* Mutual exclusion */
-	struct cdev cdev;
-	char devname[20];
-	struct ldd_device ldev;
+	struct cdev *cdev;        /* while bound: open files may outlive it */
+	struct ldd_device *ldev;  /* its bus device, while present */
+	int present;              /* the slot holds a registered device */
+	int users;                /* open files */
+	int tuned;                /* order and qset were set through sysfs */
+	unsigned long nquanta;    /* statistics, shown in sysfs */
+	unsigned long rbytes, wbytes;
+	atomic_t dma_pending;     /* reads in the copy engine */
+	wait_queue_head_t dma_wait; /* trim waits for them */
 };
 
 extern struct sculld_dev *sculld_devices;
@@ -76,6 +86,9 @@ extern struct file_operations sculld_fops;
  */
 extern int sculld_major;     /* main.c */
 extern int sculld_devs;
+extern int sculld_max_devs;
+extern int sculld_dma;       /* dma.c */
+extern int sculld_dma_min;
 extern int sculld_order;
 extern int sculld_qset;
 
@@ -84,6 +97,9 @@ extern int sculld_qset;
  */
 int sculld_trim(struct sculld_dev *dev);
 struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
+ssize_t sculld_dma_read(struct kiocb *iocb, struct iov_iter *to);
+void sculld_dma_init(void);
+void sculld_dma_cleanup(void);
 
 
 #ifdef SCULLD_DEBUG
@@ -29,6 +29,11 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>	/* ivo_iter* */
+#include <linux/mm.h>		/* kvfree() */
+#include <linux/vmalloc.h>
+#include <linux/huge_mm.h>	/* HPAGE_PMD_ORDER */
+#include <linux/workqueue.h>
+#include <linux/version.h>
 #include "scullp.h"		/* local definitions */
 #include "scull-shared/scull-async.h"
 #include "access_ok_version.h"
@@ -38,19 +43,195 @@ int scullp_major =   SCULLP_MAJOR;
 int scullp_devs =    SCULLP_DEVS;	/* number of bare scullp devices */
 int scullp_qset =    SCULLP_QSET;
 int scullp_order =   SCULLP_ORDER;
+int scullp_huge =    0;	/* 2MB quanta, mapped with huge pages */
+int scullp_numa =    SCULLP_NUMA_LOCAL;	/* initial placement of all devices */
+int scullp_numa_node = 0;	/* the node, for SCULLP_NUMA_BIND */
+int scullp_compact = 0;	/* compact memory when a quantum is short */
 
 module_param(scullp_major, int, 0);
 module_param(scullp_devs, int, 0);
 module_param(scullp_qset, int, 0);
 module_param(scullp_order, int, 0);
+module_param(scullp_huge, int, 0);
+module_param(scullp_numa, int, 0);
+module_param(scullp_numa_node, int, 0);
+module_param(scullp_compact, int, 0644);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scullp_dev *scullp_devices; /* allocated in scullp_init */
+static unsigned long *scullp_node_pages; /* nr_node_ids per device */
 
 int scullp_trim(struct scullp_dev *dev);
 void scullp_cleanup(void);
 
+/*
+ * The node for the next quantum of the device, according to its
+ * placement policy. Called with the mutex held.
+ */
+static int scullp_node(struct scullp_dev *dev)
+{
+	switch (dev->numa) {
+	case SCULLP_NUMA_INTERLEAVE:
+		dev->next_node = next_node_in(dev->next_node,
+				node_states[N_MEMORY]);
+		return dev->next_node;
+	case SCULLP_NUMA_BIND:
+		return dev->numa_node;
+	default: /* SCULLP_NUMA_LOCAL */
+		return numa_node_id();
+	}
+}
+
+/*
+ * Compaction can't be started from a module, but an allocation that
+ * may retry compacts memory on its way. When a quantum could not get
+ * its block, the worker does such an allocation, out of the writer's
+ * way, and gives the block back: the next quantum may find it.
+ */
+static int scullp_compact_order, scullp_compact_nid;
+static unsigned long scullp_compact_runs, scullp_compact_hits;
+
+static void scullp_compact_fn(struct work_struct *work)
+{
+	int order = xchg(&scullp_compact_order, 0);
+	struct page *page;
+
+	if (!order)
+		return;
+	page = alloc_pages_node(READ_ONCE(scullp_compact_nid),
+			GFP_KERNEL | __GFP_RETRY_MAYFAIL | __GFP_NOWARN, order);
+	scullp_compact_runs++;
+	if (page) {
+		__free_pages(page, order);
+		scullp_compact_hits++;
+	}
+}
+static DECLARE_WORK(scullp_compact_work, scullp_compact_fn);
+
+static void scullp_kick_compaction(int order, int nid)
+{
+	if (order > READ_ONCE(scullp_compact_order)) {
+		WRITE_ONCE(scullp_compact_nid, nid);
+		WRITE_ONCE(scullp_compact_order, order);
+	}
+	schedule_work(&scullp_compact_work);
+}
+
+/*
+ * One block of 2^order pages, split so that every page has its own
+ * reference count and can be mapped to user space alone. We don't
+ * work hard for large blocks: there is a plan B.
+ */
+static struct page *scullp_alloc_block(int order, int nid, gfp_t thisnode)
+{
+	gfp_t gfp = GFP_KERNEL | thisnode;
+	struct page *page;
+
+	if (order)
+		gfp |= __GFP_NORETRY | __GFP_NOWARN;
+	page = alloc_pages_node(nid, gfp, order);
+	if (page && order)
+		split_page(page, order);
+	return page;
+}
+
+/*
+ * Plan B: assemble the quantum from the largest blocks we can get,
+ * falling back one order at a time down to single pages, and make it
+ * contiguous with vmap().  Reads and writes don't see the difference;
+ * the quantum is just mapped to user space with small pages.  The area
+ * owns the pages and the array (VM_MAP_PUT_PAGES), so vfree() releases
+ * all of it; older kernels have no plan B.
+ */
+static void *scullp_alloc_pieces(int order, int nid, gfp_t thisnode,
+		int *achieved)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+	int i, j, k = order - 1, n = 1 << order;
+	struct page **pages, *page;
+	void *addr;
+
+	pages = kvmalloc_array(n, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return NULL;
+	/* "i" stays a multiple of the block size, as "k" only decreases */
+	for (i = 0; i < n; i += 1 << k) {
+		while (!(page = scullp_alloc_block(k, nid, thisnode)) && k)
+			k--;
+		if (!page)
+			goto fail;
+		for (j = 0; j < (1 << k); j++)
+			pages[i + j] = page + j;
+	}
+	addr = vmap(pages, n, VM_MAP | VM_MAP_PUT_PAGES, PAGE_KERNEL);
+	if (addr) {
+		*achieved = k;
+		return addr;
+	}
+  fail:
+	while (i--)
+		__free_page(pages[i]);
+	kvfree(pages);
+#endif
+	return NULL;
+}
+
+/*
+ * A quantum is 2^order pages, a single block if possible, to keep read
+ * and write efficient.  "*achieved" is the order of the smallest block
+ * in it. A quantum is always released one page at a time.
+ */
+static void *scullp_alloc_quantum(struct scullp_dev *dev, int *achieved)
+{
+	int order = dev->order, nid = scullp_node(dev);
+	gfp_t thisnode = 0;
+	struct page *page;
+
+	/* a bound device rather fails than spills to another node */
+	if (dev->numa == SCULLP_NUMA_BIND)
+		thisnode = __GFP_THISNODE;
+	page = scullp_alloc_block(order, nid, thisnode);
+	if (page) {
+		*achieved = order;
+		return page_address(page);
+	}
+	if (!order)
+		return NULL;
+	if (scullp_compact)
+		scullp_kick_compaction(order, nid);
+	return scullp_alloc_pieces(order, nid, thisnode, achieved);
+}
+
+/*
+ * Count the pages of a quantum on their nodes ("delta" is 1 or -1).
+ * A block from the buddy allocator sits on a single node; a quantum
+ * made of small pages has to be checked a page at a time.
+ */
+static void scullp_account(struct scullp_dev *dev, void *quantum, long delta)
+{
+	unsigned long i, n = 1UL << dev->order;
+
+	if (!is_vmalloc_addr(quantum)) {
+		dev->node_pages[page_to_nid(virt_to_page(quantum))] += n * delta;
+		return;
+	}
+	for (i = 0; i < n; i++)
+		dev->node_pages[page_to_nid(scullp_quantum_page(quantum, i))] += delta;
+}
+
+static void scullp_free_quantum(void *quantum, int order)
+{
+	int i;
+
+	if (is_vmalloc_addr(quantum)) {
+		vfree(quantum);
+		return;
+	}
+	for (i = 0; i < (1 << order); i++)
+		free_page((unsigned long)quantum + (i << PAGE_SHIFT));
+}
+
 
 
 
@@ -76,6 +257,9 @@ int scullp_read_procmem(struct seq_file *m, void *v)
 		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		if (scullp_huge)
+			seq_printf(m,"  huge: %lu mapped, %lu fallbacks\n",
+					d->huge_maps, d->huge_fallbacks);
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -111,6 +295,85 @@ static struct file_operations scullp_proc_ops = {
 
 #endif /* SCULLP_USE_PROC */
 
+/*
+ * The placement of the devices is always visible, to check locality:
+ * one line per device, with its policy and its pages on every node.
+ */
+static int scullp_numa_show(struct seq_file *m, void *v)
+{
+	static const char *policy[] = { "local", "interleave", "bind" };
+	struct scullp_dev *d;
+	int i, nid;
+
+	for (i = 0; i < scullp_devs; i++) {
+		d = scullp_devices + i;
+		if (mutex_lock_interruptible(&d->mutex))
+			return -ERESTARTSYS;
+		seq_printf(m, "scullp%i: %s", i, policy[d->numa]);
+		if (d->numa == SCULLP_NUMA_BIND)
+			seq_printf(m, " %i", d->numa_node);
+		for_each_node_state(nid, N_MEMORY)
+			seq_printf(m, " N%i=%lu", nid, d->node_pages[nid]);
+		seq_putc(m, '\n');
+		mutex_unlock(&d->mutex);
+	}
+	return 0;
+}
+
+/*
+ * Allocations by the order they achieved: one line per device with
+ * the quanta ever allocated ("allocs") and those currently held, then
+ * the work done to compact memory.
+ */
+static int scullp_orders_show(struct seq_file *m, void *v)
+{
+	struct scullp_dev *d;
+	int i, order;
+
+	for (i = 0; i < scullp_devs; i++) {
+		d = scullp_devices + i;
+		if (mutex_lock_interruptible(&d->mutex))
+			return -ERESTARTSYS;
+		seq_printf(m, "scullp%i: order %i\n  allocs:", i, d->order);
+		for (order = 0; order <= SCULLP_MAX_ORDER; order++)
+			seq_printf(m, " %lu", d->allocs[order]);
+		seq_puts(m, "\n  quanta:");
+		for (order = 0; order <= SCULLP_MAX_ORDER; order++)
+			seq_printf(m, " %lu", d->quanta[order]);
+		seq_putc(m, '\n');
+		mutex_unlock(&d->mutex);
+	}
+	seq_printf(m, "compaction: %lu runs, %lu blocks made\n",
+			scullp_compact_runs, scullp_compact_hits);
+	return 0;
+}
+
+static int scullp_orders_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scullp_orders_show, NULL);
+}
+
+static struct file_operations scullp_orders_ops = {
+	.owner = THIS_MODULE,
+	.open = scullp_orders_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+static int scullp_numa_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scullp_numa_show, NULL);
+}
+
+static struct file_operations scullp_numa_ops = {
+	.owner = THIS_MODULE,
+	.open = scullp_numa_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
 /*
  * Open and close
  */
@@ -217,7 +480,7 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, achieved;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (mutex_lock_interruptible(&dev->mutex))
@@ -231,18 +494,27 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	/* follow the list up to the right position */
 	dptr = scullp_follow(dev, item);
 	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+		/* the pointers, then the order achieved by every quantum */
+		dptr->data = kmalloc(qset * (sizeof(void *) + 1), GFP_KERNEL);
 		if (!dptr->data)
 			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
+		memset(dptr->data, 0, qset * (sizeof(void *) + 1));
+		dptr->orders = (u8 *)(dptr->data + qset);
 	}
-	/* Here's the allocation of a single quantum */
+	/*
+	 * Here's the allocation of a single quantum. The order is the one
+	 * of the device: list items after the first don't carry it.
+	 */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
+		dptr->data[s_pos] = scullp_alloc_quantum(dev, &achieved);
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+		dptr->orders[s_pos] = achieved;
+		achieved = min(achieved, SCULLP_MAX_ORDER);
+		dev->allocs[achieved]++;
+		dev->quanta[achieved]++;
+		scullp_account(dev, dptr->data[s_pos], 1);
+		memset(dptr->data[s_pos], 0, quantum);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -270,6 +542,7 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	struct scullp_dev *dev = filp->private_data;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -350,6 +623,28 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullp_qset = arg;
 		return tmp;
 
+	case SCULLP_IOCTNUMA: /* Tell, but for this device only */
+		if (arg > SCULLP_NUMA_BIND)
+			return -EINVAL;
+		mutex_lock(&dev->mutex);
+		dev->numa = arg;
+		mutex_unlock(&dev->mutex);
+		break;
+
+	case SCULLP_IOCQNUMA:
+		return dev->numa;
+
+	case SCULLP_IOCTNODE: /* the node of SCULLP_NUMA_BIND */
+		if (arg >= nr_node_ids || !node_state(arg, N_MEMORY))
+			return -EINVAL;
+		mutex_lock(&dev->mutex);
+		dev->numa_node = arg;
+		mutex_unlock(&dev->mutex);
+		break;
+
+	case SCULLP_IOCQNODE:
+		return dev->numa_node;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -405,6 +700,9 @@ struct file_operations scullp_fops = {
 	.write =     scullp_write,
 	.unlocked_ioctl = scullp_ioctl,
 	.mmap =	     scullp_mmap,
+#ifdef SCULLP_HUGE
+	.get_unmapped_area = thp_get_unmapped_area, /* 2MB-aligned if we can */
+#endif
 	.open =	     scullp_open,
 	.release =   scullp_release,
 	.read_iter =  scull_read_iter,
@@ -424,16 +722,24 @@ int scullp_trim(struct scullp_dev *dev)
 		if (dptr->data) {
 			/* This code frees a whole quantum-set */
 			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+				if (dptr->data[i]) {
+					dev->quanta[min_t(int, dptr->orders[i],
+							SCULLP_MAX_ORDER)]--;
+					scullp_account(dev, dptr->data[i], -1);
+					scullp_free_quantum(dptr->data[i],
+							dev->order);
+				}
 
 			kfree(dptr->data);
 			dptr->data=NULL;
+			dptr->orders=NULL;
 		}
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	kvfree(dev->pages);
+	dev->pages = NULL;
+	dev->npages = 0;
 	dev->size = 0;
 	dev->qset = scullp_qset;
 	dev->order = scullp_order;
@@ -478,6 +784,15 @@ int scullp_init(void)
 	if (result < 0)
 		return result;
 
+	/* huge mode: quanta are as large as a PMD mapping */
+	if (scullp_huge) {
+#ifdef SCULLP_HUGE
+		scullp_order = HPAGE_PMD_ORDER;
+#else
+		printk(KERN_NOTICE "scullp: no huge mappings in this kernel\n");
+		scullp_huge = 0;
+#endif
+	}
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -489,9 +804,26 @@ int scullp_init(void)
 		goto fail_malloc;
 	}
 	memset(scullp_devices, 0, scullp_devs*sizeof (struct scullp_dev));
+	scullp_node_pages = kcalloc(scullp_devs * nr_node_ids,
+			sizeof(unsigned long), GFP_KERNEL);
+	if (!scullp_node_pages) {
+		result = -ENOMEM;
+		goto fail_nodes;
+	}
+	if (scullp_numa < SCULLP_NUMA_LOCAL || scullp_numa > SCULLP_NUMA_BIND ||
+			scullp_numa_node < 0 || scullp_numa_node >= nr_node_ids ||
+			!node_state(scullp_numa_node, N_MEMORY)) {
+		printk(KERN_NOTICE "scullp: bad NUMA policy, using local\n");
+		scullp_numa = SCULLP_NUMA_LOCAL;
+		scullp_numa_node = first_memory_node;
+	}
 	for (i = 0; i < scullp_devs; i++) {
 		scullp_devices[i].order = scullp_order;
 		scullp_devices[i].qset = scullp_qset;
+		scullp_devices[i].numa = scullp_numa;
+		scullp_devices[i].numa_node = scullp_numa_node;
+		scullp_devices[i].next_node = scullp_numa_node;
+		scullp_devices[i].node_pages = scullp_node_pages + i * nr_node_ids;
 		mutex_init(&scullp_devices[i].mutex);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
@@ -500,8 +832,12 @@ int scullp_init(void)
 #ifdef SCULLP_USE_PROC /* only when available */
 	proc_create("scullpmem", 0, NULL, proc_ops_wrapper(&scullp_proc_ops, scullp_pops));
 #endif
+	proc_create("scullpnuma", 0, NULL, proc_ops_wrapper(&scullp_numa_ops, scullp_numa_pops));
+	proc_create("scullporders", 0, NULL, proc_ops_wrapper(&scullp_orders_ops, scullp_orders_pops));
 	return 0; /* succeed */
 
+  fail_nodes:
+	kfree(scullp_devices);
   fail_malloc:
 	unregister_chrdev_region(dev, scullp_devs);
 	return result;
@@ -516,12 +852,16 @@ void scullp_cleanup(void)
 #ifdef SCULLP_USE_PROC
 	remove_proc_entry("scullpmem", NULL);
 #endif
+	remove_proc_entry("scullpnuma", NULL);
+	remove_proc_entry("scullporders", NULL);
+	cancel_work_sync(&scullp_compact_work);
 
 	for (i = 0; i < scullp_devs; i++) {
 		cdev_del(&scullp_devices[i].cdev);
 		scullp_trim(scullp_devices + i);
 	}
 	kfree(scullp_devices);
+	kfree(scullp_node_pages);
 	unregister_chrdev_region(MKDEV (scullp_major, 0), scullp_devs);
 }
 
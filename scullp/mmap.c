@@ -19,11 +19,16 @@
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/slab.h>		/* kvcalloc() */
 #include <asm/pgtable.h>
 #include <linux/fs.h>
 #include <linux/version.h>
+#include <linux/huge_mm.h>
 #include "scullp.h"		/* local definitions */
 
+int scullp_mmap_populate = 1;	/* map present pages at mmap time */
+module_param(scullp_mmap_populate, int, 0);
+
 
 /*
  * open and close: just keep track of how many times the device is
@@ -50,18 +55,18 @@ void scullp_vma_close(struct vm_area_struct *vma)
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * A multipage block would normally only have a count in its first
+ * page, and unmapping any other page would drop a count that isn't
+ * there. This is why quanta of any "order" are split at allocation
+ * time (see main.c): every page of the block is then a page of its
+ * own and can be mapped here.
  */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
 typedef int vm_fault_t;
 #endif
 static vm_fault_t scullp_vma_nopage(struct vm_fault *vmf)
 {
-	unsigned long offset;
+	unsigned long offset, pgidx;
 	struct vm_area_struct *vma = vmf->vma;
 	struct scullp_dev *ptr, *dev = vma->vm_private_data;
 	struct page *page = NULL;
@@ -72,20 +77,30 @@ static vm_fault_t scullp_vma_nopage(struct vm_fault *vmf)
 	offset = (unsigned long)(vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
 	if (offset >= dev->size) goto out; /* out of range */
 
+	/* most pages are in the index: no need to walk the list */
+	if ((offset >> PAGE_SHIFT) < dev->npages &&
+			dev->pages[offset >> PAGE_SHIFT]) {
+		page = dev->pages[offset >> PAGE_SHIFT];
+		goto found;
+	}
+
 	/*
 	 * Now retrieve the scullp device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
 	 * accessing the hole.
 	 */
 	offset >>= PAGE_SHIFT; /* offset is a number of pages */
+	pgidx = offset & ((1 << dev->order) - 1); /* page in the quantum */
+	offset >>= dev->order; /* now a number of quanta */
 	for (ptr = dev; ptr && offset >= dev->qset;) {
 		ptr = ptr->next;
 		offset -= dev->qset;
 	}
 	if (ptr && ptr->data) pageptr = ptr->data[offset];
 	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
+	page = scullp_quantum_page(pageptr, pgidx);
 
+  found:
 	/* got it, now increment the count */
 	get_page(page);
 	vmf->page = page;
@@ -98,25 +113,189 @@ static vm_fault_t scullp_vma_nopage(struct vm_fault *vmf)
 
 
 
+/*
+ * Build the direct page index of the device, one entry per page up to
+ * the current size, with a single walk of the list. Holes are NULL;
+ * pages written later are still found by the fault handler the slow
+ * way. The index lives until the next trim, which can't happen while
+ * the device is mapped. Called with the mutex held.
+ */
+static int scullp_build_index(struct scullp_dev *dev)
+{
+	unsigned long npages = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	unsigned long n = 0, j, per = 1UL << dev->order;
+	struct scullp_dev *ptr;
+	struct page **pages;
+	int i;
+
+	pages = kvcalloc(npages ? npages : 1, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	for (ptr = dev; ptr && n < npages; ptr = ptr->next)
+		for (i = 0; i < dev->qset && n < npages; i++)
+			for (j = 0; j < per && n < npages; j++, n++)
+				if (ptr->data && ptr->data[i])
+					pages[n] = scullp_quantum_page(ptr->data[i], j);
+	kvfree(dev->pages);
+	dev->pages = pages;
+	dev->npages = npages;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+/* vm_insert_pages() appeared in 5.8: insert them one by one */
+static int scullp_insert_pages(struct vm_area_struct *vma, unsigned long addr,
+		struct page **pages, unsigned long *num)
+{
+	int err;
+
+	for (; *num; (*num)--, pages++, addr += PAGE_SIZE) {
+		err = vm_insert_page(vma, addr, *pages);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+#else
+#define scullp_insert_pages vm_insert_pages
+#endif
+
+/*
+ * Map all the pages we already have at mmap time, in batches of
+ * contiguous present pages, so that a scan of the area doesn't take
+ * a fault every page. Whatever is left is handled by "nopage".
+ */
+static void scullp_populate(struct vm_area_struct *vma, struct scullp_dev *dev)
+{
+	unsigned long start = vma->vm_pgoff, end = start + vma_pages(vma);
+	unsigned long pg, run, left;
+
+	if (end > dev->npages)
+		end = dev->npages;
+	for (pg = start; pg < end; pg += run) {
+		for (run = 0; pg + run < end && dev->pages[pg + run]; run++)
+			;
+		if (!run) {
+			run = 1; /* a hole */
+			continue;
+		}
+		left = run;
+		if (scullp_insert_pages(vma,
+				vma->vm_start + ((pg - start) << PAGE_SHIFT),
+				dev->pages + pg, &left))
+			return; /* the fault handler will do the rest */
+	}
+}
+
+#ifdef SCULLP_HUGE
+/*
+ * In huge mode, a quantum is a 2MB block that can be mapped with a
+ * single PMD entry, if the area is aligned on it. The core calls us
+ * first for every 2MB of the area with no page table yet; anything
+ * we can't do (a hole, a quantum built from smaller blocks, a misaligned
+ * or short area) falls back to "nopage", one page at a time. The PMD
+ * maps a pfn and takes no page reference: the pages stay put because
+ * the device can't be trimmed while mapped.
+ */
+static vm_fault_t scullp_vma_huge_fault(struct vm_fault *vmf,
+		unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scullp_dev *ptr, *dev = vma->vm_private_data;
+	unsigned long haddr = vmf->address & HPAGE_PMD_MASK;
+	unsigned long pgoff, qidx, pfn;
+	void *quantum = NULL;
+	vm_fault_t retval = VM_FAULT_FALLBACK;
+
+	if (order != HPAGE_PMD_ORDER)
+		return VM_FAULT_FALLBACK;
+	/* a write to a private mapping needs its copy: "nopage" does it */
+	if ((vmf->flags & FAULT_FLAG_WRITE) && !(vma->vm_flags & VM_SHARED))
+		return VM_FAULT_FALLBACK;
+
+	mutex_lock(&dev->mutex);
+	pgoff = vma->vm_pgoff + ((haddr - vma->vm_start) >> PAGE_SHIFT);
+	if (dev->order != HPAGE_PMD_ORDER || haddr < vma->vm_start ||
+			haddr + HPAGE_PMD_SIZE > vma->vm_end ||
+			(pgoff & (HPAGE_PMD_NR - 1)) ||
+			((pgoff + HPAGE_PMD_NR) << PAGE_SHIFT) > dev->size)
+		goto out;
+
+	qidx = pgoff >> HPAGE_PMD_ORDER;
+	for (ptr = dev; ptr && qidx >= dev->qset; ptr = ptr->next)
+		qidx -= dev->qset;
+	if (ptr && ptr->data)
+		quantum = ptr->data[qidx];
+	if (!quantum || ptr->orders[qidx] != HPAGE_PMD_ORDER)
+		goto out; /* a hole, or made of smaller blocks */
+	pfn = page_to_pfn(virt_to_page(quantum));
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0)
+	retval = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn),
+			vmf->flags & FAULT_FLAG_WRITE);
+#else
+	retval = vmf_insert_pfn_pmd(vmf, pfn,
+			vmf->flags & FAULT_FLAG_WRITE);
+#endif
+	if (retval == VM_FAULT_NOPAGE)
+		dev->huge_maps++;
+
+  out:
+	if (retval == VM_FAULT_FALLBACK)
+		dev->huge_fallbacks++;
+	mutex_unlock(&dev->mutex);
+	return retval;
+}
+#endif
+
+
 struct vm_operations_struct scullp_vm_ops = {
 	.open =     scullp_vma_open,
 	.close =    scullp_vma_close,
 	.fault =   scullp_vma_nopage,
+#ifdef SCULLP_HUGE
+	.huge_fault = scullp_vma_huge_fault,
+#endif
 };
 
+/*
+ * Huge mappings need a mixed map (PMDs of plain pfns next to pages
+ * with a count) and VM_HUGEPAGE, or the core never asks for them
+ * unless THP is "always" enabled.
+ */
+static int scullp_huge_vma(struct vm_area_struct *vma, struct scullp_dev *dev)
+{
+#ifdef SCULLP_HUGE
+	if (!scullp_huge || dev->order != HPAGE_PMD_ORDER)
+		return 0;
+	vm_flags_set(vma, VM_MIXEDMAP | VM_HUGEPAGE);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_path.dentry->d_inode;
-
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
+	struct scullp_dev *dev = filp->private_data;
+	int huge;
 
-	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &scullp_vm_ops;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_private_data = dev;
+
+	/*
+	 * Index the pages and map those we have, unless they are to be
+	 * mapped huge; the fault handlers set up the page table entries
+	 * for anything else. Count the mapping before releasing the
+	 * mutex, so that no trim can free the pages.
+	 */
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	huge = scullp_huge_vma(vma, dev);
+	if (scullp_build_index(dev) == 0 && scullp_mmap_populate && !huge)
+		scullp_populate(vma, dev);
 	scullp_vma_open(vma);
+	mutex_unlock(&dev->mutex);
 	return 0;
 }
-
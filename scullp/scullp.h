@@ -16,6 +16,8 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include <linux/mm.h>
+#include <linux/version.h>
 
 /*
  * Macros to help debugging
@@ -46,12 +48,35 @@
  * Use a linked list of indirect blocks.
  *
  * "scullp_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * pointer refers to a memory page; "orders" follows it in the
+ * same allocation.
  *
  * The array (quantum-set) is SCULLP_QSET long.
  */
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
+#define SCULLP_MAX_ORDER 10 /* larger orders are counted with this one */
+
+/*
+ * Huge mode maps a quantum with a single PMD. The quantum is made of
+ * order-0 pages (see scullp_alloc_block()), so the PMD must be marked
+ * special, or GUP takes it for a transparent huge page and gets the
+ * page counts wrong. vmf_insert_pfn_pmd() only does that since 6.12,
+ * on architectures with PMD pfn mappings.
+ */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && \
+	defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#define SCULLP_HUGE
+#endif
+
+/*
+ * Where the pages of a device are allocated: on the node of the
+ * writer, round-robin on all nodes with memory, or on a given node.
+ */
+#define SCULLP_NUMA_LOCAL      0
+#define SCULLP_NUMA_INTERLEAVE 1
+#define SCULLP_NUMA_BIND       2
 
 struct scullp_dev {
 	void **data;
@@ -60,6 +85,17 @@ struct scullp_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct page **pages;      /* direct page index, built by mmap */
+	unsigned long npages;     /* entries in "pages" */
+	unsigned long huge_maps;  /* PMD mappings installed */
+	unsigned long huge_fallbacks; /* huge faults served with small pages */
+	u8 *orders;               /* order achieved by each quantum */
+	unsigned long allocs[SCULLP_MAX_ORDER + 1]; /* quanta by order achieved */
+	unsigned long quanta[SCULLP_MAX_ORDER + 1]; /* same, currently held */
+	int numa;                 /* placement policy, see below */
+	int numa_node;            /* the node for SCULLP_NUMA_BIND */
+	int next_node;            /* last node used by SCULLP_NUMA_INTERLEAVE */
+	unsigned long *node_pages; /* pages of the device on every node */
 	struct mutex mutex;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -75,6 +111,22 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_huge;      /* main.c */
+extern int scullp_numa;
+extern int scullp_numa_node;
+extern int scullp_compact;
+
+/*
+ * A quantum that can't get a block of its order is made of smaller
+ * blocks, mapped contiguously in vmalloc space.  Find the n-th page of
+ * a quantum of either kind.
+ */
+static inline struct page *scullp_quantum_page(void *quantum, unsigned long n)
+{
+	void *addr = quantum + (n << PAGE_SHIFT);
+
+	return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+}
 
 /*
  * Prototypes for shared functions
@@ -117,7 +169,13 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 #define SCULLP_IOCXQSET    _IOWR(SCULLP_IOC_MAGIC,11, int)
 #define SCULLP_IOCHQSET    _IO(SCULLP_IOC_MAGIC,  12)
 
-#define SCULLP_IOC_MAXNR 12
+/* placement of this device only, "Tell" and "Query" */
+#define SCULLP_IOCTNUMA    _IO(SCULLP_IOC_MAGIC,  13)
+#define SCULLP_IOCQNUMA    _IO(SCULLP_IOC_MAGIC,  14)
+#define SCULLP_IOCTNODE    _IO(SCULLP_IOC_MAGIC,  15)
+#define SCULLP_IOCQNODE    _IO(SCULLP_IOC_MAGIC,  16)
+
+#define SCULLP_IOC_MAXNR 16
 
 
 
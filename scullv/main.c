@@ -29,6 +29,7 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>		/* kvfree() */
 #include "scull-shared/scull-async.h"
 #include "scullv.h"		/* local definitions */
 #include "access_ok_version.h"
@@ -38,11 +39,15 @@ int scullv_major =   SCULLV_MAJOR;
 int scullv_devs =    SCULLV_DEVS;	/* number of bare scullv devices */
 int scullv_qset =    SCULLV_QSET;
 int scullv_order =   SCULLV_ORDER;
+int scullv_flat =    0;	/* one contiguous area per device */
+int scullv_flat_step = SCULLV_FLAT_STEP; /* least growth of the area */
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_flat, int, 0);
+module_param(scullv_flat_step, int, 0644);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -76,6 +81,11 @@ int scullv_read_procmem(struct seq_file *m, void *v)
 		order = d->order;
 		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		if (scullv_flat) {
+			seq_printf(m,"  area at %p, %lu bytes\n",
+					d->area, (unsigned long)d->area_size);
+			goto out;
+		}
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -157,6 +167,67 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Flat mode: make the area of the device at least "size" bytes long.
+ * A vmalloc area can't be extended, so a larger one replaces it: by
+ * half the current size, and no less than the step, to keep the
+ * copies rare. The area comes from vmalloc_user(), which zeroes it and
+ * lets remap_vmalloc_range() map it. Mapped pages can't be moved, so
+ * a mapped device can't grow. Called with the mutex held.
+ */
+int scullv_grow(struct scullv_dev *dev, size_t size)
+{
+	size_t step = max_t(size_t, READ_ONCE(scullv_flat_step), PAGE_SIZE);
+	size_t newsize;
+	void *area;
+
+	if (size <= dev->area_size)
+		return 0;
+	if (dev->vmas)
+		return -EBUSY;
+	newsize = max(size, dev->area_size + dev->area_size / 2);
+	newsize = roundup(newsize, step);
+	newsize = PAGE_ALIGN(newsize);
+	area = vmalloc_user(newsize);
+	if (!area)
+		return -ENOMEM;
+	if (dev->area) {
+		memcpy(area, dev->area, dev->size);
+		vfree(dev->area);
+	}
+	dev->area = area;
+	dev->area_size = newsize;
+	return 0;
+}
+
+static ssize_t scullv_flat_read(struct scullv_dev *dev, char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	if (*f_pos >= dev->size)
+		return 0;
+	if (*f_pos + count > dev->size)
+		count = dev->size - *f_pos;
+	if (copy_to_user(buf, dev->area + *f_pos, count))
+		return -EFAULT;
+	*f_pos += count;
+	return count;
+}
+
+static ssize_t scullv_flat_write(struct scullv_dev *dev, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	int err = scullv_grow(dev, *f_pos + count);
+
+	if (err)
+		return err;
+	if (copy_from_user(dev->area + *f_pos, buf, count))
+		return -EFAULT;
+	*f_pos += count;
+	if (dev->size < *f_pos)
+		dev->size = *f_pos;
+	return count;
+}
+
 /*
  * Data management: read and write
  */
@@ -174,6 +245,10 @@ ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
 
 	if (mutex_lock_interruptible(&dev->mutex))
 		return -ERESTARTSYS;
+	if (scullv_flat) {
+		retval = scullv_flat_read(dev, buf, count, f_pos);
+		goto nothing;
+	}
 	if (*f_pos > dev->size) 
 		goto nothing;
 	if (*f_pos + count > dev->size)
@@ -222,6 +297,10 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 
 	if (mutex_lock_interruptible(&dev->mutex))
 		return -ERESTARTSYS;
+	if (scullv_flat) {
+		retval = scullv_flat_write(dev, buf, count, f_pos);
+		goto nomem;
+	}
 
 	/* find listitem, qset index and offset in the quantum */
 	item = ((long) *f_pos) / itemsize;
@@ -238,10 +317,10 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Allocate a quantum using virtual addresses */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
+		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dev->order);
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+		memset(dptr->data[s_pos], 0, quantum);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -431,6 +510,12 @@ int scullv_trim(struct scullv_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	kvfree(dev->pages);
+	dev->pages = NULL;
+	dev->npages = 0;
+	vfree(dev->area);
+	dev->area = NULL;
+	dev->area_size = 0;
 	dev->size = 0;
 	dev->qset = scullv_qset;
 	dev->order = scullv_order;
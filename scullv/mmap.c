@@ -19,12 +19,17 @@
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/slab.h>		/* kvcalloc() */
+#include <linux/vmalloc.h>	/* remap_vmalloc_range() */
 #include <asm/pgtable.h>
 #include <linux/version.h>
 #include <linux/fs.h>
 
 #include "scullv.h"		/* local definitions */
 
+int scullv_mmap_populate = 1;	/* map present pages at mmap time */
+module_param(scullv_mmap_populate, int, 0);
+
 
 /*
  * open and close: just keep track of how many times the device is
@@ -51,11 +56,9 @@ void scullv_vma_close(struct vm_area_struct *vma)
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * A vmalloc area is made of single pages, each with its own count,
+ * so quanta of any "order" can be mapped: just find the right page
+ * inside the quantum.
  */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
 typedef int vm_fault_t;
@@ -63,7 +66,7 @@ typedef int vm_fault_t;
 
 static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
 {
-	unsigned long offset;
+	unsigned long offset, pgidx;
 	struct vm_area_struct *vma = vmf->vma;
 	struct scullv_dev *ptr, *dev = vma->vm_private_data;
 	struct page *page = NULL;
@@ -74,18 +77,28 @@ static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
 	offset = (unsigned long)(vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
 	if (offset >= dev->size) goto out; /* out of range */
 
+	/* most pages are in the index: no need to walk the list */
+	if ((offset >> PAGE_SHIFT) < dev->npages &&
+			dev->pages[offset >> PAGE_SHIFT]) {
+		page = dev->pages[offset >> PAGE_SHIFT];
+		goto found;
+	}
+
 	/*
 	 * Now retrieve the scullv device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
 	 * accessing the hole.
 	 */
 	offset >>= PAGE_SHIFT; /* offset is a number of pages */
+	pgidx = offset & ((1 << dev->order) - 1); /* page in the quantum */
+	offset >>= dev->order; /* now a number of quanta */
 	for (ptr = dev; ptr && offset >= dev->qset;) {
 		ptr = ptr->next;
 		offset -= dev->qset;
 	}
 	if (ptr && ptr->data) pageptr = ptr->data[offset];
 	if (!pageptr) goto out; /* hole or end-of-file */
+	pageptr += pgidx << PAGE_SHIFT;
 
 	/*
 	 * After scullv lookup, "page" is now the address of the page
@@ -94,6 +107,7 @@ static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
 	 */
 	page = vmalloc_to_page(pageptr);
 
+  found:
 	/* got it, now increment the count */
 	get_page(page);
 	vmf->page = page;
@@ -106,6 +120,102 @@ static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
 
 
 
+/*
+ * Build the direct page index of the device, one entry per page up to
+ * the current size, with a single walk of the list. Holes are NULL;
+ * pages written later are still found by the fault handler the slow
+ * way. The index lives until the next trim, which can't happen while
+ * the device is mapped. Called with the mutex held.
+ */
+static int scullv_build_index(struct scullv_dev *dev)
+{
+	unsigned long npages = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	unsigned long n = 0, j, per = 1UL << dev->order;
+	struct scullv_dev *ptr;
+	struct page **pages;
+	int i;
+
+	pages = kvcalloc(npages ? npages : 1, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	for (ptr = dev; ptr && n < npages; ptr = ptr->next)
+		for (i = 0; i < dev->qset && n < npages; i++)
+			for (j = 0; j < per && n < npages; j++, n++)
+				if (ptr->data && ptr->data[i])
+					pages[n] = vmalloc_to_page(ptr->data[i] + (j << PAGE_SHIFT));
+	kvfree(dev->pages);
+	dev->pages = pages;
+	dev->npages = npages;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+/* vm_insert_pages() appeared in 5.8: insert them one by one */
+static int scullv_insert_pages(struct vm_area_struct *vma, unsigned long addr,
+		struct page **pages, unsigned long *num)
+{
+	int err;
+
+	for (; *num; (*num)--, pages++, addr += PAGE_SIZE) {
+		err = vm_insert_page(vma, addr, *pages);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+#else
+#define scullv_insert_pages vm_insert_pages
+#endif
+
+/*
+ * Map all the pages we already have at mmap time, in batches of
+ * contiguous present pages, so that a scan of the area doesn't take
+ * a fault every page. Whatever is left is handled by "nopage".
+ */
+static void scullv_populate(struct vm_area_struct *vma, struct scullv_dev *dev)
+{
+	unsigned long start = vma->vm_pgoff, end = start + vma_pages(vma);
+	unsigned long pg, run, left;
+
+	if (end > dev->npages)
+		end = dev->npages;
+	for (pg = start; pg < end; pg += run) {
+		for (run = 0; pg + run < end && dev->pages[pg + run]; run++)
+			;
+		if (!run) {
+			run = 1; /* a hole */
+			continue;
+		}
+		left = run;
+		if (scullv_insert_pages(vma,
+				vma->vm_start + ((pg - start) << PAGE_SHIFT),
+				dev->pages + pg, &left))
+			return; /* the fault handler will do the rest */
+	}
+}
+
+/*
+ * Flat mode: the area is contiguous, so it is mapped in one go and no
+ * fault ever reaches us. The area must cover the whole mapping: grow
+ * it if needed, which is only possible for the first mapping. The part
+ * beyond the end of the device reads as zeros.
+ */
+static int scullv_flat_mmap(struct vm_area_struct *vma, struct scullv_dev *dev)
+{
+	unsigned long end = (vma->vm_pgoff << PAGE_SHIFT) +
+			(vma->vm_end - vma->vm_start);
+	int err;
+
+	err = scullv_grow(dev, end);
+	if (err)
+		return err == -EBUSY ? -EINVAL : err;
+	err = remap_vmalloc_range(vma, dev->area, vma->vm_pgoff);
+	if (err)
+		return err;
+	scullv_vma_open(vma);
+	return 0;
+}
+
 struct vm_operations_struct scullv_vm_ops = {
 	.open =     scullv_vma_open,
 	.close =    scullv_vma_close,
@@ -115,11 +225,27 @@ struct vm_operations_struct scullv_vm_ops = {
 
 int scullv_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+	struct scullv_dev *dev = filp->private_data;
 
-	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &scullv_vm_ops;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_private_data = dev;
+
+	/*
+	 * Index the pages and map those we have; "nopage" sets up the
+	 * page table entries for anything else. Count the mapping before
+	 * releasing the mutex, so that no trim can free the pages.
+	 */
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	if (scullv_flat) {
+		int err = scullv_flat_mmap(vma, dev);
+
+		mutex_unlock(&dev->mutex);
+		return err;
+	}
+	if (scullv_build_index(dev) == 0 && scullv_mmap_populate)
+		scullv_populate(vma, dev);
 	scullv_vma_open(vma);
+	mutex_unlock(&dev->mutex);
 	return 0;
 }
-
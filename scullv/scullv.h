@@ -53,6 +53,13 @@
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
 
+/*
+ * In flat mode (scullv_flat=1) the list is not used: every device
+ * owns a single vmalloc area, grown in steps of SCULLV_FLAT_STEP or
+ * more, and an offset is just an offset in it.
+ */
+#define SCULLV_FLAT_STEP (1 << 20)
+
 struct scullv_dev {
 	void **data;
 	struct scullv_dev *next;  /* next listitem */
@@ -60,6 +67,10 @@ struct scullv_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct page **pages;      /* direct page index, built by mmap */
+	unsigned long npages;     /* entries in "pages" */
+	void *area;               /* flat mode: all the data, contiguous */
+	size_t area_size;         /* flat mode: allocated size of "area" */
 	struct mutex mutex;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -75,12 +86,14 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_flat;
 
 /*
  * Prototypes for shared functions
  */
 int scullv_trim(struct scullv_dev *dev);
 struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
+int scullv_grow(struct scullv_dev *dev, size_t size);
 
 
 #ifdef SCULLV_DEBUG